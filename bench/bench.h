@@ -0,0 +1,52 @@
+/*
+ * Shared by the benchmarks
+ *
+ * Pulls in the editor itself and provides the clock and the generated
+ * log file most of them load.
+ */
+
+#ifndef MIM_BENCH_H
+#define MIM_BENCH_H
+
+// Pull in the editor itself, keeping its main out of the way
+#define main mim_main
+#include "../mim.c"
+#undef main
+
+/**
+ * Wall clock time in seconds
+ */
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Write a file of roughly mb megabytes of log-like lines
+ */
+void generate(const char *path, int mb)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        die("fopen");
+
+    long long target = (long long)mb << 20;
+    long long written = 0;
+    unsigned seed = 1;
+    while (written < target)
+    {
+        seed = seed * 1103515245 + 12345;
+        int width = 10 + (seed >> 16) % 110;
+        int n = fprintf(fp, "%08lld\tINFO\tworker-%u ", written, (seed >> 8) % 64);
+        int j;
+        for (j = n; j < width; j++)
+            fputc('a' + (j + seed) % 26, fp);
+        fputc('\n', fp);
+        written += width > n ? width + 1 : n + 1;
+    }
+    fclose(fp);
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * Load-time benchmark for editor_open
+ *
+ * Generates files of the given sizes (in MB, default 16 64 256) and times
+ * the first screenful of rows coming in from the loader thread, the whole
+ * load against the old getline + editor_insert_row loop, and freeing the
+ * loaded buffer.
+ */
+
+#include "bench.h"
+
+/**
+ * Start over with an empty buffer, timing how long freeing it takes
+ */
+double reset_buffer()
+{
+    double start = now();
+    editor_free_rows();
+    return now() - start;
+}
+
+/**
+ * The loader editor_open used to have, one getline and one insert per line
+ */
+void load_getline(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1)
+    {
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            linelen--;
+        editor_insert_row(E.numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+    int sizes[16] = {16, 64, 256};
+    int nsizes = 3;
+    if (argc > 1)
+    {
+        nsizes = 0;
+        while (nsizes < 16 && nsizes + 1 < argc)
+        {
+            sizes[nsizes] = atoi(argv[nsizes + 1]);
+            nsizes++;
+        }
+    }
+
+    E.rows = rows_node_new(0);
+    // The loader thread wakes the event loop through its pipe
+    editor_init_events();
+    // The first frame waits for a screenful of rows
+    E.screenrows = 24;
+    printf("%8s %10s %10s %12s %12s %10s %10s\n", "size", "lines", "first (ms)", "bulk (s)", "getline (s)", "MB/s", "free (s)");
+
+    int i;
+    for (i = 0; i < nsizes; i++)
+    {
+        char path[] = "/tmp/mim-bench-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd == -1)
+            die("mkstemp");
+        close(fd);
+        generate(path, sizes[i]);
+
+        // Rows arrive from the loader thread, the first ones are what
+        // the editor can draw its first frame with
+        double start = now();
+        editor_open(path);
+        while (E.numrows < E.screenrows && E.load)
+        {
+            if (!editor_load_step(false))
+                editor_wait(-1);
+        }
+        double first = (now() - start) * 1000;
+        editor_load_step(true);
+        double bulk = now() - start;
+        int lines = E.numrows;
+        double close = reset_buffer();
+
+        start = now();
+        load_getline(path);
+        double old = now() - start;
+        reset_buffer();
+
+        printf("%6dMB %10d %10.2f %12.3f %12.3f %10.1f %10.3f\n", sizes[i], lines, first, bulk, old, sizes[i] / bulk, close);
+        unlink(path);
+    }
+    return 0;
+}
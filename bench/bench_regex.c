@@ -0,0 +1,112 @@
+/*
+ * Regex search benchmark for regex_row_find
+ *
+ * Loads generated log lines (in MB, default 64) and counts the rows
+ * matching typical grep patterns with the editor's regex engine and
+ * with POSIX regexec.
+ */
+
+#include "bench.h"
+
+#include <regex.h>
+
+/**
+ * Write a file of roughly mb megabytes of web server log lines
+ */
+void generate_access_log(const char *path, int mb)
+{
+    static const char *levels[] = {"INFO", "INFO", "INFO", "INFO", "INFO", "INFO", "DEBUG", "WARN", "WARN", "ERROR"};
+    static const char *methods[] = {"GET", "GET", "GET", "POST", "PUT", "DELETE"};
+    static const char *paths[] = {"users", "orders", "items", "carts", "health", "login"};
+    static const char *notes[] = {"ok", "ok", "ok", "cache hit", "cache miss", "slow query", "upstream timeout", "retrying"};
+
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        die("fopen");
+
+    long long target = (long long)mb << 20;
+    long long written = 0;
+    unsigned seed = 1;
+    long line = 0;
+    while (written < target)
+    {
+        seed = seed * 1103515245 + 12345;
+        unsigned r = seed >> 8;
+        int status = r % 50 == 0 ? 500 + r % 4 : r % 10 == 0 ? 404 : 200;
+        written += fprintf(fp, "2024-05-%02ld %02ld:%02ld:%02ld.%03u %s [worker-%u] %s /api/%s/%u %d %ums from 10.%u.%u.%u: %s\n",
+                           1 + line / 500000 % 28, line / 3600 % 24, line / 60 % 60, line % 60, r % 1000,
+                           levels[r % 10], r % 32, methods[(r >> 4) % 6], paths[(r >> 7) % 6], r % 100000,
+                           status, r % 900 + 1, r % 256, (r >> 8) % 256, (r >> 16) % 256, notes[(r >> 5) % 8]);
+        line++;
+    }
+    fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+    int mb = argc > 1 ? atoi(argv[1]) : 64;
+    const char *patterns[] = {
+        "ERROR",
+        "ERROR.*timeout",
+        "worker-(1|2)[0-9]\\]",
+        "(POST|PUT) /api/orders/[0-9]+ 50[0-9]",
+        "[0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+: slow",
+        "^2024-05-0[1-3] ",
+        "[0-9][0-9][0-9][0-9]ms",
+        "(cache|slow) [a-z]+$",
+    };
+    int npatterns = sizeof(patterns) / sizeof(patterns[0]);
+
+    char path[] = "/tmp/mim-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+        die("mkstemp");
+    close(fd);
+    generate_access_log(path, mb);
+
+    E.rows = rows_node_new(0);
+    // The loader thread wakes the event loop through its pipe
+    editor_init_events();
+    editor_open(path);
+    editor_load_step(true);
+    unlink(path);
+    printf("%dMB, %d lines\n", mb, E.numrows);
+    printf("%-40s %9s %10s %10s %8s\n", "pattern", "rows", "mim (s)", "posix (s)", "MB/s");
+
+    int i;
+    for (i = 0; i < npatterns; i++)
+    {
+        struct regex *re = regex_compile(patterns[i]);
+        regex_t posix;
+        if (re == NULL || regcomp(&posix, patterns[i], REG_EXTENDED | REG_NOSUB) != 0)
+        {
+            fprintf(stderr, "bad pattern %s\n", patterns[i]);
+            return 1;
+        }
+
+        int j;
+        long found = 0;
+        double start = now();
+        for (j = 0; j < E.numrows; j++)
+            if (regex_row_find(re, editor_row(j), 0, 1) != -1)
+                found++;
+        double mim = now() - start;
+
+        long expected = 0;
+        start = now();
+        for (j = 0; j < E.numrows; j++)
+            if (regexec(&posix, editor_row_chars(editor_row(j)), 0, NULL, 0) == 0)
+                expected++;
+        double libc = now() - start;
+
+        if (found != expected)
+        {
+            fprintf(stderr, "mismatch for %s: %ld vs %ld\n", patterns[i], found, expected);
+            return 1;
+        }
+        printf("%-40s %9ld %10.3f %10.3f %8.1f\n", patterns[i], found, mim, libc, mb / mim);
+        regex_free(re);
+        regfree(&posix);
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Keystroke replay benchmark
+ *
+ * Runs the editor headless on a generated file of the given size (in MB,
+ * default 64) with a virtual screen (COLSxROWS, default 200x50) and
+ * replays typing, pasting, cutting and pasting back blocks of lines,
+ * paging down and saving one key at a time.
+ * Reports latency percentiles, heap allocations and output bytes per key.
+ */
+
+#include "bench.h"
+
+/**
+ * Allocations the editor made so far, as counted by its profiler
+ */
+long long allocs()
+{
+    return __atomic_load_n(&E.prof.mallocs, __ATOMIC_RELAXED) + __atomic_load_n(&E.prof.reallocs, __ATOMIC_RELAXED);
+}
+
+// Latency, allocations and output of each key of one operation
+struct op_stats
+{
+    const char *name;
+    double *ms;
+    long long allocs;
+    long long bytes;
+    int n, cap;
+};
+
+/**
+ * Add the cost of one key to st
+ */
+void add(struct op_stats *st, double ms, long long nallocs, long long bytes)
+{
+    if (st->n == st->cap)
+    {
+        st->cap = st->cap ? st->cap * 2 : 256;
+        st->ms = realloc(st->ms, sizeof(double) * st->cap);
+    }
+    st->ms[st->n++] = ms;
+    st->allocs += nallocs;
+    st->bytes += bytes;
+}
+
+/**
+ * Replay one key (or key sequence) and add what it cost to st
+ */
+void replay(struct op_stats *st, const char *keys, size_t len)
+{
+    E.capture.len = 0;
+    long long before = allocs();
+    double start = now();
+    editor_headless_run(keys, len);
+    double ms = (now() - start) * 1000;
+    add(st, ms, allocs() - before, E.capture.len);
+}
+
+/**
+ * Replay keys that only set up the next operation
+ */
+void setup(const char *keys)
+{
+    editor_headless_run(keys, strlen(keys));
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Print percentiles of an operation's latencies
+ */
+void report(struct op_stats *st)
+{
+    qsort(st->ms, st->n, sizeof(double), compare_double);
+    printf("%-10s %7d %9.3f %9.3f %9.3f %9.3f %9.1f %9lld\n", st->name, st->n,
+           st->ms[st->n / 2], st->ms[st->n * 90 / 100], st->ms[st->n * 99 / 100],
+           st->ms[st->n - 1], (double)st->allocs / st->n, st->bytes / st->n);
+    free(st->ms);
+}
+
+int main(int argc, char *argv[])
+{
+    int mb = argc > 1 ? atoi(argv[1]) : 64;
+    int cols = 200, rows = 50;
+    if (argc > 2)
+        sscanf(argv[2], "%dx%d", &cols, &rows);
+
+    char path[] = "/tmp/mim-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+        die("mkstemp");
+    close(fd);
+    generate(path, mb);
+
+    E.headless = true;
+    E.screencols = cols;
+    E.screenrows = rows;
+    init_editor();
+    double start = now();
+    editor_open(path);
+    editor_load_step(true);
+    printf("%dMB, %d lines, %dx%d screen, opened in %.3f s\n\n", mb, E.numrows, cols, rows, now() - start);
+    editor_refresh_screen();
+
+    char keys[64];
+    int j;
+
+    // Typing in the middle of the file, a new line every 50 keys and
+    // a typo fixed every 10
+    struct op_stats type = {.name = "type"};
+    snprintf(keys, sizeof(keys), "\x07%d\r", E.numrows / 2);
+    setup(keys);
+    const char *text = "the quick brown fox jumps over the lazy dog ";
+    for (j = 0; j < 5000; j++)
+    {
+        char c = j % 50 == 49 ? '\r' : j % 10 == 9 ? BACKSPACE : text[j % 44];
+        replay(&type, &c, 1);
+    }
+
+    // Pasting blocks of 5000 lines
+    struct op_stats paste = {.name = "paste"};
+    struct abuf block = ABUT_INIT;
+    ab_append(&block, "\x1b[200~", 6);
+    for (j = 0; j < 5000; j++)
+    {
+        int len = snprintf(keys, sizeof(keys), "pasted line %d\tof the block\n", j);
+        ab_append(&block, keys, len);
+    }
+    ab_append(&block, "\x1b[201~", 6);
+    for (j = 0; j < 50; j++)
+        replay(&paste, block.b, block.len);
+    ab_free(&block);
+
+    // Cutting blocks of 5000 lines and pasting them back further down
+    struct op_stats cut = {.name = "cut"};
+    struct op_stats yank = {.name = "yank"};
+    for (j = 0; j < 50; j++)
+    {
+        snprintf(keys, sizeof(keys), "\x07%d\r\x02\x07%d\r", E.numrows / 4, E.numrows / 4 + 4999);
+        setup(keys);
+        replay(&cut, "\x0b", 1);
+        snprintf(keys, sizeof(keys), "\x07%d\r", E.numrows * 3 / 4);
+        setup(keys);
+        replay(&yank, "\x16", 1);
+    }
+
+    // Paging down from the top
+    struct op_stats page = {.name = "page-down"};
+    setup("\x07" "1\r");
+    for (j = 0; j < 5000; j++)
+        replay(&page, "\x1b[6~", 4);
+
+    // Saving, both the pause while typing and the write behind it
+    struct op_stats save = {.name = "save"};
+    struct op_stats written = {.name = "save-write"};
+    for (j = 0; j < 5; j++)
+    {
+        setup("x");
+        replay(&save, "\x13", 1);
+        E.capture.len = 0;
+        long long before = allocs();
+        double start = now();
+        editor_finish_save(true);
+        editor_refresh_screen();
+        add(&written, (now() - start) * 1000, allocs() - before, E.capture.len);
+    }
+
+    printf("%-10s %7s %9s %9s %9s %9s %9s %9s\n", "op", "keys", "p50 (ms)", "p90 (ms)", "p99 (ms)", "max (ms)", "allocs", "bytes");
+    report(&type);
+    report(&paste);
+    report(&cut);
+    report(&yank);
+    report(&page);
+    report(&save);
+    report(&written);
+
+    editor_journal_close(true);
+    unlink(path);
+    return 0;
+}
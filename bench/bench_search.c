@@ -0,0 +1,109 @@
+/*
+ * Search benchmark for editor_row_find
+ *
+ * Loads a generated file of the given size (in MB, default 64) and counts
+ * every match of a few queries with editor_row_find and with the strstr
+ * loop a plain search would use.
+ */
+
+#include "bench.h"
+
+/**
+ * Count matches of query in the whole buffer with editor_row_find
+ */
+long count_find(const char *query)
+{
+    int qlen = strlen(query);
+    long count = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++)
+    {
+        erow *row = editor_row(j);
+        int col = 0;
+        while ((col = editor_row_find(row, col, query, qlen, 1)) != -1)
+        {
+            count++;
+            col++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Count matches of query in the whole buffer with strstr
+ */
+long count_strstr(const char *query)
+{
+    long count = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++)
+    {
+        erow *row = editor_row(j);
+        char *p = editor_row_chars(row);
+        while ((p = strstr(p, query)) != NULL)
+        {
+            count++;
+            p++;
+        }
+    }
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    int mb = argc > 1 ? atoi(argv[1]) : 64;
+    const char *queries[] = {"qzqzq", "worker-63 ", "\tINFO\t", "xyz"};
+    int nqueries = sizeof(queries) / sizeof(queries[0]);
+
+    char path[] = "/tmp/mim-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+        die("mkstemp");
+    close(fd);
+    generate(path, mb);
+
+    E.rows = rows_node_new(0);
+    // The loader thread wakes the event loop through its pipe
+    editor_init_events();
+    editor_open(path);
+    editor_load_step(true);
+    unlink(path);
+    printf("%dMB, %d lines\n", mb, E.numrows);
+    printf("%-14s %10s %12s %12s %10s\n", "query", "matches", "find (s)", "strstr (s)", "MB/s");
+
+    int i;
+    for (i = 0; i < nqueries; i++)
+    {
+        double start = now();
+        long found = count_find(queries[i]);
+        double find = now() - start;
+
+        start = now();
+        long expected = count_strstr(queries[i]);
+        double naive = now() - start;
+
+        if (found != expected)
+        {
+            fprintf(stderr, "mismatch for \"%s\": %ld vs %ld\n", queries[i], found, expected);
+            return 1;
+        }
+
+        // Tabs would throw the columns off
+        char label[32];
+        int j, k = 0;
+        for (j = 0; queries[i][j] && k < (int)sizeof(label) - 3; j++)
+        {
+            if (queries[i][j] == '\t')
+            {
+                label[k++] = '\\';
+                label[k++] = 't';
+            }
+            else
+                label[k++] = queries[i][j];
+        }
+        label[k] = '\0';
+
+        printf("%-14s %10ld %12.3f %12.3f %10.1f\n", label, found, find, naive, mb / find);
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Tab kernel microbenchmark
+ *
+ * Times every set of tab kernels the CPU supports (the scalar loops the
+ * editor always had, SSE2, AVX2) finding tabs, measuring render width and
+ * rendering rows of the given length (default 120 bytes) on tab-free,
+ * tab-separated and tab-indented text. Reports MB/s of row text.
+ */
+
+#include "bench.h"
+
+// Row text each run goes through, in rows of the given length
+#define BENCH_BYTES (4 << 20)
+#define BENCH_PASSES 16
+
+/**
+ * Fill text with rows of random letters where one byte in every
+ * (on average) is a tab, or with indent leading tabs per row
+ */
+void generate_text(char *text, int rowlen, int every, int indent)
+{
+    unsigned seed = 1;
+    int j;
+    for (j = 0; j < BENCH_BYTES; j++)
+    {
+        seed = seed * 1103515245 + 12345;
+        if (j % rowlen < indent || (every && (seed >> 16) % every == 0))
+            text[j] = '\t';
+        else
+            text[j] = 'a' + (seed >> 16) % 26;
+    }
+}
+
+// Keeps the compiler from dropping results
+volatile long long sink;
+
+/**
+ * MB/s one kernel goes through text at, op 0 find, 1 width, 2 render
+ */
+double run(const struct tab_kernels *k, int op, const char *text, int rowlen, char *out)
+{
+    long long total = 0;
+    double start = now();
+    int pass, j;
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+    {
+        for (j = 0; j + rowlen <= BENCH_BYTES; j += rowlen)
+        {
+            if (op == 0)
+                total += k->find(&text[j], rowlen);
+            else if (op == 1)
+                total += k->width(&text[j], rowlen, 0);
+            else
+                total += k->render(out, 0, &text[j], rowlen);
+        }
+    }
+    double secs = now() - start;
+    sink = total;
+    return (double)BENCH_BYTES * BENCH_PASSES / (1 << 20) / secs;
+}
+
+int main(int argc, char *argv[])
+{
+    int rowlen = argc > 1 ? atoi(argv[1]) : 120;
+    if (rowlen < 1)
+        rowlen = 1;
+
+    struct
+    {
+        const char *name;
+        int every, indent;
+    } inputs[] = {
+        {"tab-free", 0, 0},
+        {"tsv", 8, 0},
+        {"indented", 0, 3},
+    };
+    const char *ops[] = {"find", "width", "render"};
+
+    char *text = malloc(BENCH_BYTES);
+    char *out = malloc((size_t)rowlen * MIM_TAB_SIZE + 1);
+    printf("%d byte rows, MB/s\n\n%-10s %-8s", rowlen, "input", "op");
+    int k, i, op;
+    for (k = 0; k < tab_nkernels; k++)
+    {
+        if (editor_tab_supported(&tab_kernels[k]))
+            printf(" %10s", tab_kernels[k].name);
+    }
+    printf("\n");
+
+    for (i = 0; i < (int)(sizeof(inputs) / sizeof(inputs[0])); i++)
+    {
+        generate_text(text, rowlen, inputs[i].every, inputs[i].indent);
+        for (op = 0; op < 3; op++)
+        {
+            printf("%-10s %-8s", inputs[i].name, ops[op]);
+            for (k = 0; k < tab_nkernels; k++)
+            {
+                if (editor_tab_supported(&tab_kernels[k]))
+                    printf(" %10.0f", run(&tab_kernels[k], op, text, rowlen, out));
+            }
+            printf("\n");
+        }
+    }
+
+    free(text);
+    free(out);
+    return 0;
+}
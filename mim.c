@@ -17,11 +17,64 @@
 #include <string.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 /*** DEFINES ***/
 #define MIM_VERSION "1.0.0"
 #define MIM_TAB_SIZE 4
 #define MIM_QUIT_TIMES 1
+// Seconds a status message stays up
+#define MIM_MSG_TIMEOUT 5
+// Milliseconds to wait for the rest of an escape sequence
+#define MIM_ESC_TIMEOUT 50
+// Milliseconds of searching per keystroke before yielding to input
+#define MIM_FIND_BUDGET 10
+// Rows at least this long keep a gap at the last edit and an index of
+// their text in chunks, so edits and cursor moves don't walk the whole row
+#define MIM_LONG_LINE (64 << 10)
+// Bytes per chunk of a long row's index, chunks are split past twice this
+#define MIM_LONG_CHUNK 4096
+// Long rows at a time, rows keep their index in E.lines in 16 bits.
+// Past this rows stay short, just slower to edit
+#define MIM_LONG_SLOTS (USHRT_MAX + 1)
+// Memory the undo journal may use, oldest steps are dropped past it
+#define MIM_UNDO_LIMIT (64 << 20)
+// Blocks of lines kept for pasting, the oldest is dropped past this
+#define MIM_KILL_RING 8
+// Recovery journal: file magic, header and record header sizes,
+// and how long the flusher lets records pile up before a sync (ms)
+#define MIM_JOURNAL_MAGIC "MIMJNL1\n"
+#define MIM_JOURNAL_HEADER 32
+#define MIM_JOURNAL_RECORD 17
+#define MIM_JOURNAL_INTERVAL 500
+// Most threads used by replace-all, and fewest rows worth giving one
+#define MIM_REPLACE_THREADS 16
+#define MIM_REPLACE_MIN_ROWS 8192
+// AVX2 tab kernels are built on any x86-64 and used if the CPU has it
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MIM_AVX2
+#endif
+// Most lazily built DFA states a regex keeps before starting over
+#define MIM_RE_DFA_STATES 2048
+// Longest required literal kept for the regex prefilter
+#define MIM_RE_LITERAL_MAX 64
+// DFA states tried when matching an empty row
+#define MIM_RE_EMPTY_STATES 64
 
 // Emulate CTRL + inputs (sets first three bits to 0 to emulate ASCII behaviour)
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -39,24 +92,598 @@ enum editorKey
     END_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    // Bracketed paste, the pasted text is in E.paste
+    PASTE_KEY,
+    // Nothing typed, but the screen needs redrawing
+    // (window resized, message expired, background work finished)
+    REFRESH_KEY,
+};
+
+// Undo record kinds, see editor_undo_record
+enum undo_type
+{
+    // Text inserted into or deleted from a row
+    UNDO_INSERT,
+    UNDO_DELETE,
+    UNDO_INSERT_ROW,
+    UNDO_DELETE_ROW,
+    // Whole text of a row replaced
+    UNDO_SET_ROW,
+    // Run of whole rows, x is how many and the text their lines
+    UNDO_INSERT_ROWS,
+    UNDO_DELETE_ROWS,
+};
+
+// Parts of a frame timed by the profiler, see editor_prof_end
+enum prof_phase
+{
+    // Handling keys, less time spent waiting for them
+    PROF_KEY,
+    PROF_SCROLL,
+    // Drawing rows and bars into the frame buffer
+    PROF_DRAW,
+    // Writing the frame to the terminal
+    PROF_WRITE,
+    // Ctrl-S up to handing the snapshot to the writer thread
+    PROF_SAVE,
+    PROF_PHASES,
+};
+
+// Regex input symbols, the bytes plus the start and end of the row
+#define RE_BEGIN 256
+#define RE_END 257
+#define RE_SYMS 258
+
+// Regex parse tree nodes
+enum re_type
+{
+    RE_SET,
+    RE_CAT,
+    RE_ALT,
+    RE_STAR,
+    RE_PLUS,
+    RE_QUEST,
+    RE_EMPTY,
+};
+
+// Regex NFA instructions
+enum re_op
+{
+    // Consume a symbol in set x
+    RE_OP_SET,
+    // Continue at both x and y
+    RE_OP_SPLIT,
+    RE_OP_JMP,
+    RE_OP_MATCH,
+};
+
+// Escape sequences (after the ESC) decoded by editor_read_key
+struct key_seq
+{
+    const char *seq;
+    int key;
+};
+
+const struct key_seq key_seqs[] = {
+    {"[A", ARROW_UP},
+    {"[B", ARROW_DOWN},
+    {"[C", ARROW_RIGHT},
+    {"[D", ARROW_LEFT},
+    {"[H", HOME_KEY},
+    {"[F", END_KEY},
+    {"[1~", HOME_KEY},
+    {"[2~", END_KEY},
+    {"[3~", DEL_KEY},
+    {"[5~", PAGE_UP},
+    {"[6~", PAGE_DOWN},
+    {"[7~", HOME_KEY},
+    {"[8~", END_KEY},
+    {"OH", HOME_KEY},
+    {"OF", END_KEY},
+    // Start of bracketed paste, ends with ESC [201~
+    {"[200~", PASTE_KEY},
 };
 
 /*** DATA ***/
 
 struct termios original_termios;
 
+// Row flags
+// chars points into the read-only file mapping and is not ours to free
+#define ROW_VIEW 1
+// Row has no tabs, its render is chars itself
+#define ROW_PLAIN 2
+// Row has tabs, its render lives in the render cache
+#define ROW_TABS 4
+// chars is being written out by a background save, copy before changing it
+#define ROW_PINNED 8
+// Long row, its text has a gap and slot is its index in E.lines,
+// see editor_long_line
+#define ROW_LONG 16
+// chars has room for editor_row_cap(size) bytes, not just size + 1
+#define ROW_CAP 32
+// Text is big and has a malloc of its own, see text_alloc
+#define ROW_BIG 64
+// Text is short enough to be kept in the row itself
+#define ROW_INLINE 128
+
+// Text of up to MIM_ROW_INLINE - 1 bytes (plus the '\0') is kept inline
+#define MIM_ROW_INLINE 12
+
 typedef struct erow
 {
     // Size of actual characters
     int size;
-    // Actual data
-    char *chars;
-    // Size of render string
-    int rsize;
-    // Data to render (formatted)
-    char *render;
+    // Render cache slot and the generation it was rendered with,
+    // the slot is only valid while the cache entry has the same gen
+    unsigned gen;
+    // ROW_* flags
+    unsigned short flags;
+    unsigned short slot;
+    // Actual data, see editor_row_chars. Short text is kept right here,
+    // anything else is referred to by 32 bits instead of a pointer so a
+    // row takes 24 bytes: a place in the text arena, or for view rows
+    // their slot in E.view_rows
+    union
+    {
+        char text[MIM_ROW_INLINE];
+        uint32_t ref;
+    } u;
 } erow;
 
+// Rows with tabs are rendered when drawn into a bounded LRU cache
+#define MIM_RENDER_CACHE 512
+
+struct render_entry
+{
+    // Generation of the row rendered here, 0 if unused
+    unsigned gen;
+    // Data to render (formatted) and its size
+    char *render;
+    int rsize;
+    int cap;
+    // LRU list links, most recently used at the head
+    int prev, next;
+};
+
+// Loops over row text that expand tabs, one set per instruction set.
+// cpu is the feature __builtin_cpu_supports needs, NULL for any
+struct tab_kernels
+{
+    const char *name;
+    const char *cpu;
+    // Offset of the first tab, len if none
+    int (*find)(const char *s, int len);
+    // Render column after s when it is drawn from column rx
+    int (*width)(const char *s, int len, int rx);
+    // Render s into render from column rx on, returning the column after
+    int (*render)(char *render, int rx, const char *s, int len);
+};
+
+// Rows live in a counted B+tree: leaves hold runs of rows, inner nodes
+// hold children plus the number of rows below each child.
+// Lookup, insert and delete by line number are all O(log n)
+#define ROWS_LEAF_MAX 64
+#define ROWS_NODE_MAX 32
+// Bytes read from disk per read() when loading a file. The loader
+// thread stays up to MIM_LOAD_QUEUE bytes ahead of the buffer, which
+// takes them in for up to MIM_LOAD_BUDGET ms at a time between keys
+#define MIM_LOAD_BLOCK (1 << 20)
+#define MIM_LOAD_QUEUE (8 << 20)
+#define MIM_LOAD_BUDGET 10
+// Buffers handed to each writev() when saving, one per newline and
+// one or two per row, as long rows go out either side of their gap
+#define MIM_SAVE_IOV 1024
+// View mode (-R) keeps the file offset of every MIM_VIEW_STRIDE-th line
+// and rebuilds rows from the mapping into a small direct-mapped cache
+#define MIM_VIEW_STRIDE 64
+#define MIM_VIEW_CACHE 256
+// Row text is cut from blocks of MIM_TEXT_BLOCK bytes, text over
+// MIM_TEXT_MAX gets a malloc of its own
+#define MIM_TEXT_BLOCK_BITS 20
+#define MIM_TEXT_BLOCK (1 << MIM_TEXT_BLOCK_BITS)
+#define MIM_TEXT_MAX (16 << 10)
+// Block text is cut in units of 1 << MIM_TEXT_SHIFT bytes and referred
+// to by block and unit in 32 bits, so blocks hold up to 16 GB of text.
+// Past that text gets a malloc of its own too
+#define MIM_TEXT_SHIFT 2
+#define MIM_TEXT_UNIT_BITS (MIM_TEXT_BLOCK_BITS - MIM_TEXT_SHIFT)
+#define MIM_TEXT_BLOCKS (1 << (32 - MIM_TEXT_UNIT_BITS))
+// Dead chunks of row text beyond a quarter of the live ones plus this
+// many start a compaction, which moves rows for up to the budget (ms)
+// at a time while the keyboard is idle
+#define MIM_TEXT_SLACK 4096
+#define MIM_TEXT_BUDGET 5
+
+typedef struct rows_node
+{
+    // Entries used: rows in a leaf, children in an inner node
+    int n;
+    // Distance from the leaves, 0 for a leaf
+    int height;
+    // Trees holding the node, more than one while a save shares it
+    int refs;
+    // Neighbouring leaves, for walking rows in order
+    struct rows_node *prev, *next;
+    union
+    {
+        erow rows[ROWS_LEAF_MAX];
+        struct
+        {
+            struct rows_node *child[ROWS_NODE_MAX];
+            // Rows under each child
+            int count[ROWS_NODE_MAX];
+        } in;
+    } u;
+} rows_node;
+
+// Define a single string buffer to update at once
+// Append buffer
+struct abuf
+{
+    char *b;
+    int len;
+    // Allocated size, kept when the buffer is emptied for reuse
+    int cap;
+};
+
+// Constructor
+#define ABUT_INIT {NULL, 0, 0}
+
+// Gap of a long row when a save started
+struct save_gap
+{
+    int gap, gaplen;
+};
+
+// A save running on the writer thread
+struct save_job
+{
+    char *filename;
+    // The row tree as it was, shared with the buffer until edits copy
+    // the nodes they change, see rows_own
+    rows_node *root;
+    // Where row text was kept, and long row gaps by slot
+    struct text_block **table;
+    char **big;
+    struct save_gap *gaps;
+    // Running on its own thread, which has to be joined
+    bool threaded;
+    // Filled in by the writer thread, under lock
+    pthread_mutex_t lock;
+    bool done;
+    long long len;
+    int err;
+    double ms;
+};
+
+// Row text queued by the writer thread for the next writev()
+struct save_out
+{
+    int fd;
+    struct iovec iov[MIM_SAVE_IOV];
+    int n;
+    long long total;
+};
+
+// Whole lines read by the loader thread, waiting to become rows
+struct load_batch
+{
+    char *text;
+    size_t len;
+    struct load_batch *next;
+};
+
+// File being read in the background, see editor_load_start
+struct load_job
+{
+    int fd;
+    pthread_t thread;
+    // File size for the progress shown, 0 when not known
+    long long size;
+    // Reading a pipe or terminal, which may never end
+    bool stream;
+    // Bytes turned into rows so far, main thread only
+    long long loaded;
+    // Shared with the loader thread, under lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct load_batch *head, *tail;
+    size_t queued;
+    bool done;
+    int err;
+};
+
+// What the terminal currently shows on one screen line
+struct screen_line
+{
+    char *text;
+    // -1 when unknown, the whole line is redrawn
+    int len;
+    int cap;
+    // Drawn in inverted colors
+    int attr;
+};
+
+// New text for a row, built by a replace-all worker
+struct replace_edit
+{
+    int y;
+    char *chars;
+    int size;
+};
+
+// One change to the buffer, its text is kept in the journal's text buffer
+struct undo_rec
+{
+    unsigned char type;
+    // First change of an undo step
+    bool start;
+    // Single typed or backspaced character, later ones may extend it
+    bool typed;
+    int y, x;
+    // Cursor before the change and, on the last change of a step, after it
+    int cy, cx;
+    int acy, acx;
+    size_t off;
+    // Length of the text, for UNDO_SET_ROW the old text followed by the new
+    int len, len2;
+};
+
+// Undo journal, recs[first, pos) can be undone and recs[pos, n) redone
+struct undo_log
+{
+    struct undo_rec *recs;
+    int first, pos, n, cap;
+    // Text of the records in record order, starting at textstart
+    char *text;
+    size_t textstart, textlen, textcap;
+    // Next change starts a new undo step
+    bool seal;
+    // Changes made by undo and redo themselves aren't recorded
+    bool applying;
+    // The step being recorded outgrew the limit and is being dropped
+    bool dropping;
+    // Most memory the journal may use before old steps are dropped
+    size_t limit;
+};
+
+// Lines cut or copied for pasting, see editor_kill. Entries are the
+// lines joined by \n, the newest at head - 1
+struct kill_ring
+{
+    char *text[MIM_KILL_RING];
+    size_t len[MIM_KILL_RING];
+    int head, n;
+    // Line a block is marked from, -1 when none is
+    int mark;
+    // Key handled before the current one, cuts in a row build up one entry
+    int prev_key;
+    // The last key pasted lines, so CTRL+P may swap in an older entry
+    bool yanked;
+    // Entry pasted last (back from the newest) and the rows it took up
+    int yank, yank_at, yank_rows;
+};
+
+// Recovery journal next to the file, see editor_journal_record.
+// Records are queued in buf and written by a flusher thread
+struct journal
+{
+    // -1 until the first change
+    int fd;
+    char *path;
+    // File the journal is for, its header is made from
+    char *filename;
+    // Not journaling, the journal couldn't be created or is kept for -r
+    bool disabled;
+    // Applying the journal itself
+    bool replaying;
+    pthread_t thread;
+    // Guards buf, spare, rotate, stop and err
+    pthread_mutex_t lock;
+    // Wakes the flusher
+    pthread_cond_t cond;
+    struct abuf buf, spare;
+    bool stop;
+    // Last write error
+    int err;
+    // Bytes of records queued so far, and how many of them the
+    // save in progress already covers
+    long long len, save_mark;
+    // Mark of a finished save for the flusher to start the journal over
+    // from, -1 if none
+    long long rotate;
+    // Flusher's own: bytes of records written out, and where the
+    // journal file's records start, counted like len
+    long long written, base;
+};
+
+// Summary of a run of a long row's text, enough to know the render column
+// after it from the one before it
+struct line_chunk
+{
+    int len;
+    // Bytes before the first tab
+    int pre;
+    // Columns from the tab stop the first tab jumps to up to the end,
+    // -1 if there is no tab
+    int post;
+};
+
+// Gap and chunk index of a long row
+struct long_line
+{
+    // Text after the gap is stored gaplen bytes further up in chars
+    int gap, gaplen;
+    struct line_chunk *chunks;
+    int nchunks, chunkscap;
+    // Offset and render column each chunk starts at, worked out lazily
+    // and only known for chunks up to valid
+    int *pos, *rx;
+    int valid;
+};
+
+// Block of row text. Text is cut from the front and never reused in
+// place, the block goes once the last of its chunks is freed
+struct text_block
+{
+    // Chunks cut from the block and how many are still in use
+    int chunks, live;
+    // Bytes used, including this header
+    int used;
+    // Index in the arena's block table
+    int idx;
+    struct text_block *prev, *next;
+};
+
+// Owner of all row text. Millions of short rows then cost their bytes
+// and not a malloc each, and a buffer is freed a block at a time
+struct text_arena
+{
+    // Blocks, the one text is cut from first
+    struct text_block *blocks;
+    int nblocks;
+    // Blocks by index and big text by index, free entries are NULL and
+    // none come before the hint
+    struct text_block **table;
+    int ntable, table_hint;
+    char **big;
+    int nbig, big_hint;
+    // Chunks in use and freed but still taking space, over all blocks
+    long long live, dead;
+    // Dead chunks left by the last compaction
+    long long dead_kept;
+    // Compaction in progress and the row it continues from
+    bool compacting;
+    int compact_row;
+};
+
+// Rows handed to one replace-all worker and the edits it found
+struct replace_chunk
+{
+    // Leaf and slot of the first row and its line number
+    rows_node *leaf;
+    int slot, count, first;
+    const char *query, *with;
+    int qlen, wlen;
+    struct replace_edit *edits;
+    int nedits, editscap;
+    long matches;
+    bool threaded;
+    pthread_t thread;
+};
+
+struct re_node
+{
+    int type;
+    int left, right;
+    // Symbol set of an RE_SET node
+    int set;
+};
+
+struct re_inst
+{
+    int op;
+    int x, y;
+};
+
+// Lazily built DFA state, a sorted list of NFA instructions in the pool
+struct re_dstate
+{
+    int off, n;
+    bool match;
+};
+
+struct re_parser
+{
+    const char *p;
+    struct regex *re;
+    bool error;
+};
+
+// Compiled regex, see regex_compile
+struct regex
+{
+    struct re_node *nodes;
+    int nnodes, nodescap;
+    unsigned char (*sets)[(RE_SYMS + 7) / 8];
+    int nsets, setscap;
+    // Thompson NFA of the reversed regex
+    struct re_inst *prog;
+    int nprog, progcap;
+    // Symbols the NFA can't tell apart share a class, rep is one of each
+    int classes[RE_SYMS];
+    int rep[RE_SYMS];
+    int nclasses;
+    // DFA states and their transitions by class, -1 until first taken.
+    // Transitions hold the target's row in trans, state * nclasses,
+    // accept is set at the same index for accepting states
+    struct re_dstate *states;
+    int nstates;
+    int *trans;
+    char *accept;
+    int *hash;
+    int *pool;
+    int poollen, poolcap;
+    int start;
+    // Scratch for building states
+    int *mark, markgen;
+    int *stack, *step, *flushed;
+    // Longest run of bytes every match contains
+    char literal[MIM_RE_LITERAL_MAX];
+    int litlen;
+};
+
+// Frame timing and allocation counts, for the HUD and the trace file
+struct profile
+{
+    // Ctrl-T shows the last frame's numbers in the message bar
+    bool hud;
+    // Trace written with -t, Chrome trace events if json else CSV
+    FILE *trace;
+    bool json;
+    int frames;
+    // Allocation calls so far, from any thread
+    long long mallocs, reallocs;
+    // Time in ms spent in each phase during the frame being made,
+    // and what the last frame took
+    double phase[PROF_PHASES];
+    double last[PROF_PHASES];
+    // Allocation counts when the frame started, and the last frame's
+    long long frame_mallocs, frame_reallocs;
+    long long last_mallocs, last_reallocs;
+    // Time waiting for input or drawing frames, which doesn't count
+    // towards the key being handled meanwhile
+    double paused;
+};
+
+// Start of a timed span, see editor_prof_begin
+struct prof_span
+{
+    double start;
+    double paused;
+};
+
+// Incremental search, see editor_find
+struct find_state
+{
+    // Query the current match and scan are for
+    char *query;
+    int qlen, querycap;
+    // Current match, match_row is -1 if none
+    int match_row, match_col;
+    // Scan cut short by its time budget, resumed when idle
+    bool scanning;
+    int row, col, dir;
+    // Rows still to look at before the scan has wrapped around
+    int left;
+    // Cursor when the search started
+    int origin_cx, origin_cy;
+    // Searching for a regex, NULL while it doesn't compile
+    bool regex;
+    struct regex *re;
+};
+
 struct editor_config
 {
     // Cursor positions
@@ -73,15 +700,91 @@ struct editor_config
     // Number of rows used
     int numrows;
     // Data in each row + size
-    erow *row;
+    rows_node *rows;
+    // Last leaf looked up and the number of its first row,
+    // so walking rows in order doesn't descend the tree every time
+    rows_node *rows_hint;
+    int rows_hint_base;
     // 0 = file unmodified, 1 = file modified
     int dirty;
     // Name of file opened in editor
     char *filename;
+    // Opened with -R, the buffer can't be edited or saved
+    bool readonly;
+    // Read-only mapping of the file backing ROW_VIEW rows
+    char *map;
+    size_t maplen;
+    // Offset of every MIM_VIEW_STRIDE-th line in the mapping
+    size_t *view_index;
+    // Rows rebuilt from the mapping, slot is line number % MIM_VIEW_CACHE
+    erow view_rows[MIM_VIEW_CACHE];
+    int view_line[MIM_VIEW_CACHE];
+    char *view_chars[MIM_VIEW_CACHE];
+    // Last row rebuilt and where the line after it starts
+    int view_last;
+    size_t view_next;
+    // Rendered rows, see editor_row_render
+    struct render_entry render_cache[MIM_RENDER_CACHE];
+    int render_head, render_tail;
+    unsigned render_gen;
+    // Tab kernels in use, see editor_tab_init
+    const struct tab_kernels *tabs;
+    struct text_arena text;
+    // Index of every long row, free entries are NULL
+    struct long_line **lines;
+    int nlines;
+    // Entries in use
+    int nlong;
     // Status message below status bar
     char statusmsg[80];
     // Time when message was set
     time_t statusmsg_time;
+    // Shadow of the terminal, one entry per screen line incl. the two bars
+    struct screen_line *screen;
+    // Cursor as last drawn
+    int screen_cy, screen_cx;
+    // Bytes written to the terminal by the last frame
+    int frame_bytes;
+    // Output of the frame being drawn and the screen line being built,
+    // reused from frame to frame so drawing doesn't allocate
+    struct abuf frame;
+    struct abuf line;
+    // Keyboard input read ahead of decoding, everything available is
+    // read at once so bursts of keys are handled before the next frame
+    char inbuf[4096];
+    int inpos, inlen;
+    // Text of the last bracketed paste
+    struct abuf paste;
+    // Self-pipe that wakes the event loop from signal handlers and threads
+    int wake[2];
+    // Set by the SIGWINCH handler
+    volatile sig_atomic_t resized;
+    // Number of entries in screen
+    int screen_lines;
+    // File still being read in, NULL once all of it is in the buffer
+    struct load_job *load;
+    // Background save in progress, NULL if none
+    struct save_job *save;
+    pthread_t save_thread;
+    // Value of dirty when the save took its snapshot
+    int save_dirty;
+    // Whether the file being saved is new, for the message
+    bool save_new_file;
+    // Pinned row text replaced or deleted during the save,
+    // freed once the writer is done with it
+    char **save_garbage;
+    int save_ngarbage, save_garbagecap;
+    struct find_state find;
+    struct undo_log undo;
+    struct kill_ring kill;
+    struct journal journal;
+    struct profile prof;
+    // Running without a terminal, see editor_headless_run. Keys come
+    // from script and frames are captured instead of written out
+    bool headless;
+    const char *script;
+    size_t scriptlen;
+    struct abuf capture;
     struct termios original_termios;
 };
 
@@ -91,7 +794,136 @@ struct editor_config E;
 
 void editor_set_status_message(const char *fmt, ...);
 void editor_refresh_screen();
-char *editor_prompt(char *prompt);
+char *editor_prompt(char *prompt, void (*callback)(char *, int), bool empty);
+void ab_append(struct abuf *ab, const char *s, int len);
+void ab_fill(struct abuf *ab, char c, int n);
+void ab_free(struct abuf *ab);
+void editor_handle_resize();
+bool editor_finish_save(bool wait);
+bool editor_load_ready();
+void editor_journal_record(int type, int y, int x, const char *s, int len, const char *s2, int len2);
+void editor_journal_saved();
+int editor_row_find(erow *row, int from, const char *query, int qlen, int dir);
+int re_parse_alt(struct re_parser *ps);
+void editor_long_free(erow *row);
+void editor_row_resize(erow *row, int cap, int keep);
+void editor_row_close_gap(erow *row);
+void editor_row_unshare(erow *row);
+void rows_graft(int at, rows_node *leaf);
+
+/*** PROFILE ***/
+
+/**
+ * Monotonic time in ms
+ */
+double editor_prof_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Counting wrappers for the allocator, everything below allocates
+ * through them rather than calling it directly
+ */
+void *xmalloc(size_t size)
+{
+    __atomic_fetch_add(&E.prof.mallocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void *xcalloc(size_t n, size_t size)
+{
+    __atomic_fetch_add(&E.prof.mallocs, 1, __ATOMIC_RELAXED);
+    return calloc(n, size);
+}
+
+void *xrealloc(void *p, size_t size)
+{
+    __atomic_fetch_add(&E.prof.reallocs, 1, __ATOMIC_RELAXED);
+    return realloc(p, size);
+}
+
+char *xstrdup(const char *s)
+{
+    __atomic_fetch_add(&E.prof.mallocs, 1, __ATOMIC_RELAXED);
+    return strdup(s);
+}
+
+/**
+ * Start timing a span
+ */
+struct prof_span editor_prof_begin()
+{
+    struct prof_span span = {editor_prof_now(), E.prof.paused};
+    return span;
+}
+
+/**
+ * Add the time since span started to phase, less any time paused
+ * meanwhile, and trace it
+ */
+void editor_prof_end(int phase, struct prof_span span)
+{
+    static const char *names[PROF_PHASES] = {"keypress", "scroll", "draw", "write", "save"};
+    double end = editor_prof_now();
+    double ms = end - span.start - (E.prof.paused - span.paused);
+    E.prof.phase[phase] += ms;
+    if (E.prof.trace && E.prof.json)
+        fprintf(E.prof.trace, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.3f,\"pid\":1,\"tid\":1},\n",
+                names[phase], span.start * 1000, ms * 1000);
+}
+
+/**
+ * Close the books on a frame that wrote bytes to the terminal
+ */
+void editor_prof_frame(int bytes)
+{
+    struct profile *p = &E.prof;
+    long long mallocs = __atomic_load_n(&p->mallocs, __ATOMIC_RELAXED);
+    long long reallocs = __atomic_load_n(&p->reallocs, __ATOMIC_RELAXED);
+    p->last_mallocs = mallocs - p->frame_mallocs;
+    p->last_reallocs = reallocs - p->frame_reallocs;
+    p->frame_mallocs = mallocs;
+    p->frame_reallocs = reallocs;
+    memcpy(p->last, p->phase, sizeof(p->phase));
+    memset(p->phase, 0, sizeof(p->phase));
+    p->frames++;
+
+    if (p->trace == NULL)
+        return;
+    if (p->json)
+        fprintf(p->trace, "{\"name\":\"frame\",\"ph\":\"C\",\"ts\":%.0f,\"pid\":1,"
+                          "\"args\":{\"bytes\":%d,\"mallocs\":%lld,\"reallocs\":%lld}},\n",
+                editor_prof_now() * 1000, bytes, p->last_mallocs, p->last_reallocs);
+    else
+        fprintf(p->trace, "%d,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%lld,%lld\n", p->frames,
+                p->last[PROF_KEY], p->last[PROF_SCROLL], p->last[PROF_DRAW], p->last[PROF_WRITE],
+                p->last[PROF_SAVE], bytes, p->last_mallocs, p->last_reallocs);
+}
+
+/**
+ * Start writing the trace file, the format is picked by its extension
+ */
+void editor_prof_open(const char *path)
+{
+    struct profile *p = &E.prof;
+    p->trace = fopen(path, "w");
+    if (p->trace == NULL)
+    {
+        editor_set_status_message("Can't write trace %s: %s", path, strerror(errno));
+        return;
+    }
+    size_t len = strlen(path);
+    p->json = len >= 5 && strcmp(path + len - 5, ".json") == 0;
+    // The closing ] is optional in Chrome's array format, so a trace
+    // cut short by a crash still loads
+    if (p->json)
+        fputs("[\n", p->trace);
+    else
+        fputs("frame,keypress_ms,scroll_ms,draw_ms,write_ms,save_ms,bytes,mallocs,reallocs\n", p->trace);
+}
 
 /*** TERMINAL ***/
 
@@ -112,6 +944,8 @@ void die(const char *s)
  */
 void disable_raw_mode()
 {
+    // Turn bracketed paste back off
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.original_termios) == -1)
         die("tcsetattar");
 }
@@ -121,7 +955,7 @@ void disable_raw_mode()
  */
 void enable_raw_mode()
 {
-    if (tcgetattr(STDERR_FILENO, &E.original_termios) == -1)
+    if (tcgetattr(STDIN_FILENO, &E.original_termios) == -1)
         die("tcgetattr");
     atexit(disable_raw_mode);
 
@@ -144,749 +978,5734 @@ void enable_raw_mode()
     raw.c_iflag &= ~(BRKINT | INPCK | ISTRIP);
     raw.c_cflag |= ~(CS8);
 
-    // min num of bytes needed before read() can return
+    // read() returns whatever is available without waiting,
+    // waiting is done in poll() by editor_wait
     raw.c_cc[VMIN] = 0;
-    // 1/10 of a second
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("tcsetattr");
+
+    // Ask the terminal to wrap pastes in ESC [200~ ... ESC [201~
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 /**
- * Read a single key from keyboard input
+ * Wake the event loop, safe from signal handlers and other threads
  */
-int editor_read_key()
+void editor_wake()
 {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
-    {
-        // Cygwin returns -1 and errno = EAGAIN when read() times out
-        // So we ignore that.
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
-    }
-
-    // Input is esc key
-    // Immediately consume next bytes to check for special keys
-    if (c == '\x1b')
-    {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
-            return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
-            return '\x1b';
-
-        if (seq[0] == '[')
-        {
-            if (seq[1] >= '0' && seq[1] <= '9')
-            {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return '\x1b';
-                if (seq[2] == '~')
-                {
-                    switch (seq[1])
-                    {
-                    case '1':
-                        return HOME_KEY; // [1~
-                    case '2':
-                        return END_KEY; // [2~
-                    case '3':
-                        return DEL_KEY; // [3~
-                    case '5':
-                        return PAGE_UP; // [5~
-                    case '6':
-                        return PAGE_DOWN; // [6~
-                    case '7':
-                        return HOME_KEY; // [7~
-                    case '8':
-                        return END_KEY; // [8~
-                    default:
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                switch (seq[1])
-                {
-                case 'A':
-                    return ARROW_UP; // [A
-                case 'B':
-                    return ARROW_DOWN; // [B
-                case 'C':
-                    return ARROW_RIGHT; // [C
-                case 'D':
-                    return ARROW_LEFT; // [D
-                case 'H':
-                    return HOME_KEY; // [H
-                case 'F':
-                    return END_KEY; // [F
-                default:
-                    break;
-                }
-            }
-        }
-        else if (seq[0] == 'O')
-        {
-            switch (seq[1])
-            {
-            case 'H':
-                return HOME_KEY; // OH
-            case 'F':
-                return END_KEY; // OF
-            default:
-                break;
-            }
-        }
-
-        // Return as is for unhandled cases
-        return '\x1b';
-    }
-    else
-    {
-        return c;
-    }
+    int saved = errno;
+    write(E.wake[1], "", 1);
+    errno = saved;
 }
 
 /**
- * Get current cursor position from terminal
+ * Note the window size change and wake the event loop
  */
-int get_cursor_position(int *rows, int *cols)
+void handle_sigwinch(int sig)
 {
-    char buf[32];
-    unsigned int i = 0;
+    (void)sig;
+    E.resized = 1;
+    editor_wake();
+}
 
-    // Request cursor position (6) from Device Status Report (n)
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
-        return -1;
+/**
+ * Create the wake pipe and install signal handlers
+ */
+void editor_init_events()
+{
+    if (pipe(E.wake) == -1)
+        die("pipe");
+    // Never block on a full or empty pipe
+    fcntl(E.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.wake[1], F_SETFL, O_NONBLOCK);
+    fcntl(E.wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(E.wake[1], F_SETFD, FD_CLOEXEC);
 
-    while (i < sizeof(buf) - 1)
-    {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1)
-            break;
-        if (buf[i] == 'R')
-            break;
-        i++;
-    }
-    buf[i] = '\0';
-    if (buf[0] != '\x1b' || buf[1] != '[')
-        return -1;
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
-        return -1;
-    return 0;
+    // A headless editor has no window to resize
+    if (E.headless)
+        return;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigwinch;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
 }
 
 /**
- * Get terminal window dimensions
+ * Block until there is keyboard input, the editor is woken up or
+ * timeout ms pass (-1 waits forever). Returns true if there is input
  */
-int get_window_size(int *rows, int *cols)
+bool editor_wait(int timeout)
 {
-    struct winsize ws;
-    // Get size from ioctl into ws
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = E.wake[0];
+    fds[1].events = POLLIN;
+
+    double start = editor_prof_now();
+    int n = poll(fds, 2, timeout);
+    E.prof.paused += editor_prof_now() - start;
+    if (n == -1)
     {
-        // Fallback option:
-        // position cursor to extreme right (999C) and bottom (999B)
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[998B", 12) != 12)
-            return -1;
-        // Failure
-        return get_cursor_position(rows, cols);
+        if (errno == EINTR)
+            return false;
+        die("poll");
     }
-    else
+
+    if (fds[1].revents & POLLIN)
     {
-        // Update params
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
+        // Empty the pipe, one wake up covers everything queued so far
+        char buf[64];
+        while (read(E.wake[0], buf, sizeof(buf)) > 0)
+            ;
     }
+    return fds[0].revents != 0;
 }
 
-/*** ROW OPERATIONS ***/
-
 /**
- * Convert cursor x position to render x position accounting for tabs
+ * Milliseconds until the screen has to be redrawn without input,
+ * -1 if nothing is scheduled
  */
-int editor_row_cx_to_rx(erow *row, int cx)
+int editor_next_timeout()
 {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++)
+    // Search ran out of time, carry on as soon as the keyboard is idle
+    if (E.find.scanning)
+        return 0;
+    // Same for moving row text, which waits for a save to finish
+    if (E.text.compacting && E.save == NULL)
+        return 0;
+    // And for rows the loader has read
+    if (editor_load_ready())
+        return 0;
+    if (E.statusmsg[0] == '\0')
+        return -1;
+
+    // Status message disappears MIM_MSG_TIMEOUT seconds after it was set
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+    long long left = (E.statusmsg_time + MIM_MSG_TIMEOUT) * 1000LL - now;
+    if (left < 0)
+        return -1;
+    return left + 1;
+}
+
+/**
+ * Wait up to timeout ms for keyboard input and read all that is available
+ * into the input buffer. Returns the number of bytes read, 0 when the wait
+ * ended for another reason (timeout, signal, wake up)
+ */
+int editor_input_fill(int timeout)
+{
+    // Move undecoded bytes to the front to make room
+    E.inlen -= E.inpos;
+    memmove(E.inbuf, &E.inbuf[E.inpos], E.inlen);
+    E.inpos = 0;
+
+    if (E.headless)
+    {
+        // Scripted keys are all there, nothing to wait for
+        size_t n = sizeof(E.inbuf) - E.inlen;
+        if (n > E.scriptlen)
+            n = E.scriptlen;
+        memcpy(&E.inbuf[E.inlen], E.script, n);
+        E.script += n;
+        E.scriptlen -= n;
+        E.inlen += n;
+        return n;
+    }
+
+    if (!editor_wait(timeout))
+        return 0;
+
+    int nread = read(STDIN_FILENO, &E.inbuf[E.inlen], sizeof(E.inbuf) - E.inlen);
+    // Cygwin returns -1 and errno = EAGAIN when read() times out
+    // So we ignore that.
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
+        die("read");
+    if (nread <= 0)
+        return 0;
+    E.inlen += nread;
+    return nread;
+}
+
+/**
+ * Check whether decoded keys are still waiting in the input buffer
+ */
+bool editor_input_pending()
+{
+    return E.inpos < E.inlen;
+}
+
+/**
+ * Collect a bracketed paste into E.paste, up to its closing ESC [201~
+ */
+int editor_read_paste()
+{
+    E.paste.len = 0;
+    while (true)
+    {
+        char *start = &E.inbuf[E.inpos];
+        int avail = E.inlen - E.inpos;
+        char *end = memmem(start, avail, "\x1b[201~", 6);
+        if (end)
+        {
+            ab_append(&E.paste, start, end - start);
+            E.inpos += end - start + 6;
+            return PASTE_KEY;
+        }
+
+        // Hold back a few bytes in case the end marker is split between reads
+        int keep = avail < 5 ? avail : 5;
+        ab_append(&E.paste, start, avail - keep);
+        E.inpos += avail - keep;
+        if (editor_input_fill(-1) == 0 && E.headless)
+        {
+            // Script ended mid paste, take what there is
+            ab_append(&E.paste, E.inbuf, E.inlen);
+            E.inpos = E.inlen;
+            return PASTE_KEY;
+        }
+    }
+}
+
+/**
+ * Read a single key from keyboard input
+ */
+int editor_read_key()
+{
+    // Pick up background work that finished, redrawing to show it
+    if (editor_finish_save(false) && !editor_input_pending())
+        return REFRESH_KEY;
+
+    // Anything other than input that ends the wait asks for a redraw
+    if (!editor_input_pending() && editor_input_fill(editor_next_timeout()) == 0)
+    {
+        // A script that runs out inside a prompt cancels it
+        if (E.headless)
+            return '\x1b';
+        if (E.resized)
+            editor_handle_resize();
+        return REFRESH_KEY;
+    }
+
+    char c = E.inbuf[E.inpos];
+    if (c != '\x1b')
+    {
+        E.inpos++;
+        return c;
+    }
+
+    // Input is esc key, match what follows against the known sequences
+    while (true)
+    {
+        const char *seq = &E.inbuf[E.inpos + 1];
+        int avail = E.inlen - E.inpos - 1;
+        bool partial = false;
+        size_t j;
+        for (j = 0; j < sizeof(key_seqs) / sizeof(key_seqs[0]); j++)
+        {
+            int len = strlen(key_seqs[j].seq);
+            if (avail >= len && memcmp(seq, key_seqs[j].seq, len) == 0)
+            {
+                E.inpos += 1 + len;
+                if (key_seqs[j].key == PASTE_KEY)
+                    return editor_read_paste();
+                return key_seqs[j].key;
+            }
+            if (avail < len && memcmp(seq, key_seqs[j].seq, avail) == 0)
+                partial = true;
+        }
+
+        // Sequence may be split between reads, a lone esc times out
+        if (!partial || editor_input_fill(MIM_ESC_TIMEOUT) == 0)
+            break;
+    }
+
+    // Return as is for unhandled cases, swallowing any unknown CSI sequence
+    E.inpos++;
+    if (E.inpos < E.inlen && E.inbuf[E.inpos] == '[')
+    {
+        E.inpos++;
+        while (E.inpos < E.inlen && (E.inbuf[E.inpos] < 0x40 || E.inbuf[E.inpos] > 0x7e))
+            E.inpos++;
+        if (E.inpos < E.inlen)
+            E.inpos++;
+    }
+    return '\x1b';
+}
+
+/**
+ * Get current cursor position from terminal
+ */
+int get_cursor_position(int *rows, int *cols)
+{
+    char buf[32];
+    unsigned int i = 0;
+
+    // Request cursor position (6) from Device Status Report (n)
+    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+        return -1;
+
+    struct pollfd pfd;
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    while (i < sizeof(buf) - 1)
+    {
+        // Raw mode reads don't wait, give the terminal a second to answer
+        if (poll(&pfd, 1, 1000) != 1 || read(STDIN_FILENO, &buf[i], 1) != 1)
+            break;
+        if (buf[i] == 'R')
+            break;
+        i++;
+    }
+    buf[i] = '\0';
+    if (buf[0] != '\x1b' || buf[1] != '[')
+        return -1;
+    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+        return -1;
+    return 0;
+}
+
+/**
+ * Get terminal window dimensions
+ */
+int get_window_size(int *rows, int *cols)
+{
+    struct winsize ws;
+    // Get size from ioctl into ws
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    {
+        // Fallback option:
+        // position cursor to extreme right (999C) and bottom (999B)
+        if (write(STDOUT_FILENO, "\x1b[999C\x1b[998B", 12) != 12)
+            return -1;
+        // Failure
+        return get_cursor_position(rows, cols);
+    }
+    else
+    {
+        // Update params
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+/*** ROW TEXT ***/
+
+/**
+ * Where text is, given the block and big text tables it was handed out from
+ */
+char *text_ptr_in(struct text_block **table, char **bigs, uint32_t ref, bool big)
+{
+    if (big)
+        return bigs[ref];
+    struct text_block *b = table[ref >> MIM_TEXT_UNIT_BITS];
+    return (char *)b + ((ref & ((1u << MIM_TEXT_UNIT_BITS) - 1)) << MIM_TEXT_SHIFT);
+}
+
+/**
+ * Where text the arena handed out is
+ */
+char *text_ptr(uint32_t ref, bool big)
+{
+    return text_ptr_in(E.text.table, E.text.big, ref, big);
+}
+
+/**
+ * Unmap a block whose text is all freed
+ */
+void text_block_release(struct text_block *b)
+{
+    struct text_arena *t = &E.text;
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        t->blocks = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    t->nblocks--;
+    t->dead -= b->chunks;
+    t->table[b->idx] = NULL;
+    if (b->idx < t->table_hint)
+        t->table_hint = b->idx;
+    munmap(b, MIM_TEXT_BLOCK);
+}
+
+/**
+ * Map a new block and cut text from it from now on, NULL if refs
+ * can't reach any more blocks
+ */
+struct text_block *text_block_new()
+{
+    struct text_arena *t = &E.text;
+    int idx = t->table_hint;
+    while (idx < t->ntable && t->table[idx])
+        idx++;
+    if (idx == MIM_TEXT_BLOCKS)
+    {
+        // Don't look again until a block is released
+        t->table_hint = idx;
+        return NULL;
+    }
+    if (idx == t->ntable)
+    {
+        t->ntable = t->ntable ? t->ntable * 2 : 64;
+        t->table = xrealloc(t->table, sizeof(struct text_block *) * t->ntable);
+        memset(&t->table[idx], 0, sizeof(struct text_block *) * (t->ntable - idx));
+    }
+
+    struct text_block *b = mmap(NULL, MIM_TEXT_BLOCK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED)
+        die("mmap");
+    b->chunks = 0;
+    b->live = 0;
+    b->used = sizeof(struct text_block);
+    b->idx = idx;
+    b->prev = NULL;
+    b->next = t->blocks;
+    if (b->next)
+        b->next->prev = b;
+    t->blocks = b;
+    t->nblocks++;
+    t->table[idx] = b;
+    t->table_hint = idx + 1;
+
+    // The block text was cut from before may have emptied meanwhile
+    if (b->next && b->next->live == 0 && E.save == NULL)
+        text_block_release(b->next);
+    return b;
+}
+
+/**
+ * Get cap bytes for row text and the ref to find them again. Text over
+ * MIM_TEXT_MAX is big, so is any once the arena is out of blocks. Rows
+ * track which it is (ROW_BIG), big tells
+ */
+char *text_alloc(int cap, uint32_t *ref, bool *big)
+{
+    struct text_arena *t = &E.text;
+    // Round up to whole units
+    int units = (cap + (1 << MIM_TEXT_SHIFT) - 1) & ~((1 << MIM_TEXT_SHIFT) - 1);
+    struct text_block *b = t->blocks;
+    if (cap <= MIM_TEXT_MAX && (b == NULL || b->used + units > MIM_TEXT_BLOCK))
+        b = text_block_new();
+    *big = cap > MIM_TEXT_MAX || b == NULL;
+    if (*big)
+    {
+        int idx = t->big_hint;
+        while (idx < t->nbig && t->big[idx])
+            idx++;
+        if (idx == t->nbig)
+        {
+            t->nbig = t->nbig ? t->nbig * 2 : 64;
+            t->big = xrealloc(t->big, sizeof(char *) * t->nbig);
+            memset(&t->big[idx], 0, sizeof(char *) * (t->nbig - idx));
+        }
+        t->big[idx] = xmalloc(cap);
+        t->big_hint = idx + 1;
+        *ref = idx;
+        return t->big[idx];
+    }
+
+    *ref = (uint32_t)b->idx << MIM_TEXT_UNIT_BITS | b->used >> MIM_TEXT_SHIFT;
+    char *p = (char *)b + b->used;
+    b->used += units;
+    b->chunks++;
+    b->live++;
+    t->live++;
+    return p;
+}
+
+/**
+ * Resize big row text
+ */
+char *text_realloc_big(uint32_t ref, int cap)
+{
+    E.text.big[ref] = xrealloc(E.text.big[ref], cap);
+    return E.text.big[ref];
+}
+
+/**
+ * Take big row text out of the arena, the caller frees it
+ */
+char *text_detach_big(uint32_t ref)
+{
+    char *p = E.text.big[ref];
+    E.text.big[ref] = NULL;
+    if ((int)ref < E.text.big_hint)
+        E.text.big_hint = ref;
+    return p;
+}
+
+/**
+ * Free row text. Blocks left empty are kept while a background save
+ * may still be reading them, see text_sweep
+ */
+void text_free(uint32_t ref, bool big)
+{
+    struct text_arena *t = &E.text;
+    if (big)
+    {
+        free(text_detach_big(ref));
+        return;
+    }
+
+    struct text_block *b = t->table[ref >> MIM_TEXT_UNIT_BITS];
+    b->live--;
+    t->live--;
+    t->dead++;
+    if (b->live == 0 && b != t->blocks && E.save == NULL)
+        text_block_release(b);
+    else if (t->dead > t->dead_kept + t->live / 4 + MIM_TEXT_SLACK && !E.map)
+        t->compacting = true;
+}
+
+/**
+ * Release blocks that emptied while a save was running
+ */
+void text_sweep()
+{
+    struct text_block *b = E.text.blocks ? E.text.blocks->next : NULL;
+    while (b)
+    {
+        struct text_block *next = b->next;
+        if (b->live == 0)
+            text_block_release(b);
+        b = next;
+    }
+}
+
+/**
+ * Free all row text at once
+ */
+void text_release()
+{
+    struct text_arena *t = &E.text;
+    while (t->blocks)
+    {
+        struct text_block *next = t->blocks->next;
+        munmap(t->blocks, MIM_TEXT_BLOCK);
+        t->blocks = next;
+    }
+    int j;
+    for (j = 0; j < t->ntable; j++)
+        t->table[j] = NULL;
+    for (j = 0; j < t->nbig; j++)
+    {
+        free(t->big[j]);
+        t->big[j] = NULL;
+    }
+    t->table_hint = 0;
+    t->big_hint = 0;
+    t->nblocks = 0;
+    t->live = 0;
+    t->dead = 0;
+    t->dead_kept = 0;
+    t->compacting = false;
+    t->compact_row = 0;
+}
+
+/**
+ * Text of a row, wherever it is kept
+ */
+char *editor_row_chars(erow *row)
+{
+    if (row->flags & ROW_INLINE)
+        return row->u.text;
+    if (row->flags & ROW_VIEW)
+        return E.view_chars[row->u.ref];
+    return text_ptr(row->u.ref, row->flags & ROW_BIG);
+}
+
+/*** ROW STORAGE ***/
+
+/**
+ * Allocate an empty row tree node
+ */
+rows_node *rows_node_new(int height)
+{
+    // Inner nodes only need room for their child table
+    size_t size = sizeof(rows_node);
+    if (height)
+        size = offsetof(rows_node, u) + sizeof(((rows_node *)0)->u.in);
+
+    rows_node *node = xmalloc(size);
+    node->n = 0;
+    node->height = height;
+    node->refs = 1;
+    node->prev = NULL;
+    node->next = NULL;
+    return node;
+}
+
+/**
+ * Count the rows stored below a node
+ */
+int rows_node_count(rows_node *node)
+{
+    if (node->height == 0)
+        return node->n;
+
+    int total = 0;
+    int j;
+    for (j = 0; j < node->n; j++)
+        total += node->u.in.count[j];
+    return total;
+}
+
+/**
+ * Make the node in *slot the buffer's own before it is changed. One
+ * still shared with a save is copied and the copy takes its place, so
+ * edits only ever copy the nodes on their way down
+ */
+rows_node *rows_own(rows_node **slot)
+{
+    rows_node *node = *slot;
+    if (node->refs == 1)
+        return node;
+
+    rows_node *copy = rows_node_new(node->height);
+    copy->n = node->n;
+    int j;
+    if (node->height == 0)
+    {
+        memcpy(copy->u.rows, node->u.rows, sizeof(erow) * node->n);
+        // The save still writes the text, edits have to copy it first
+        for (j = 0; j < copy->n; j++)
+        {
+            if (!(copy->u.rows[j].flags & ROW_INLINE))
+                copy->u.rows[j].flags |= ROW_PINNED;
+        }
+        // Only the buffer walks the leaf chain, the save walks its tree
+        copy->prev = node->prev;
+        copy->next = node->next;
+        if (copy->prev)
+            copy->prev->next = copy;
+        if (copy->next)
+            copy->next->prev = copy;
+        if (E.rows_hint == node)
+            E.rows_hint = copy;
+    }
+    else
+    {
+        memcpy(copy->u.in.child, node->u.in.child, sizeof(rows_node *) * node->n);
+        memcpy(copy->u.in.count, node->u.in.count, sizeof(int) * node->n);
+        for (j = 0; j < copy->n; j++)
+            copy->u.in.child[j]->refs++;
+    }
+    node->refs--;
+    *slot = copy;
+    return copy;
+}
+
+/**
+ * Build the row for a line of a mapped file, reusing cached rows
+ */
+erow *editor_view_row(int at)
+{
+    int slot = at % MIM_VIEW_CACHE;
+    erow *row = &E.view_rows[slot];
+    if (E.view_line[slot] == at)
+        return row;
+
+    // Continue from the previous row, or scan forward from the nearest indexed line
+    size_t off;
+    if (at == E.view_last + 1)
+    {
+        off = E.view_next;
+    }
+    else
+    {
+        off = E.view_index[at / MIM_VIEW_STRIDE];
+        int skip = at % MIM_VIEW_STRIDE;
+        while (skip--)
+            off = (char *)memchr(E.map + off, '\n', E.maplen - off) - E.map + 1;
+    }
+
+    char *p = E.map + off;
+    char *nl = memchr(p, '\n', E.maplen - off);
+    size_t len = nl ? (size_t)(nl - p) : E.maplen - off;
+    E.view_last = at;
+    E.view_next = off + len + 1;
+    while (len > 0 && p[len - 1] == '\r')
+        len--;
+
+    // Rows point straight at the mapping, nothing is copied
+    if (row->flags & ROW_LONG)
+        editor_long_free(row);
+    row->size = len;
+    row->flags = ROW_VIEW;
+    row->gen = 0;
+    row->u.ref = slot;
+    E.view_chars[slot] = p;
+    E.view_line[slot] = at;
+    return row;
+}
+
+/**
+ * Find the row at a given line number
+ */
+erow *editor_row(int at)
+{
+    if (at < 0 || at >= E.numrows)
+        return NULL;
+    if (E.map)
+        return editor_view_row(at);
+
+    rows_node *leaf = E.rows_hint;
+    int base = E.rows_hint_base;
+    if (leaf)
+    {
+        // Walking rows in order stays in or next to the last leaf, unless
+        // a save shares the tree and the leaf next to it may not be ours
+        bool step = E.save == NULL;
+        if (step && at >= base + leaf->n && leaf->next && at < base + leaf->n + leaf->next->n)
+        {
+            base += leaf->n;
+            leaf = leaf->next;
+        }
+        else if (step && at < base && leaf->prev && at >= base - leaf->prev->n)
+        {
+            leaf = leaf->prev;
+            base -= leaf->n;
+        }
+        if (at >= base && at < base + leaf->n)
+        {
+            E.rows_hint = leaf;
+            E.rows_hint_base = base;
+            return &leaf->u.rows[at - base];
+        }
+    }
+
+    // Descend from the root, skipping whole subtrees by their row count.
+    // Rows are handed out to be changed, so the path is made ours
+    rows_node *node = rows_own(&E.rows);
+    base = 0;
+    while (node->height)
+    {
+        int j = 0;
+        while (j < node->n - 1 && at - base >= node->u.in.count[j])
+            base += node->u.in.count[j++];
+        node = rows_own(&node->u.in.child[j]);
+    }
+    E.rows_hint = node;
+    E.rows_hint_base = base;
+    return &node->u.rows[at - base];
+}
+
+/**
+ * Move the upper half of a full node into a new right sibling
+ */
+rows_node *rows_split(rows_node *node)
+{
+    rows_node *right = rows_node_new(node->height);
+    int half = node->n / 2;
+    right->n = node->n - half;
+
+    if (node->height == 0)
+    {
+        memcpy(right->u.rows, &node->u.rows[half], sizeof(erow) * right->n);
+        // Keep the leaf chain in order
+        right->prev = node;
+        right->next = node->next;
+        if (node->next)
+            node->next->prev = right;
+        node->next = right;
+    }
+    else
+    {
+        memcpy(right->u.in.child, &node->u.in.child[half], sizeof(rows_node *) * right->n);
+        memcpy(right->u.in.count, &node->u.in.count[half], sizeof(int) * right->n);
+    }
+    node->n = half;
+    return right;
+}
+
+/**
+ * Insert a row below node, returns the new right sibling if node had to split
+ */
+rows_node *rows_insert_at(rows_node *node, int at, erow *row)
+{
+    rows_node *right = NULL;
+    rows_node *target = node;
+
+    if (node->height == 0)
+    {
+        if (node->n == ROWS_LEAF_MAX)
+        {
+            right = rows_split(node);
+            if (at > node->n)
+            {
+                at -= node->n;
+                target = right;
+            }
+        }
+        // Shift rows [at] to [at+1] within the leaf only
+        memmove(&target->u.rows[at + 1], &target->u.rows[at], sizeof(erow) * (target->n - at));
+        target->u.rows[at] = *row;
+        target->n++;
+        return right;
+    }
+
+    // Pick the child the new row lands in, appending to it when on a boundary
+    int j = 0;
+    while (j < node->n - 1 && at > node->u.in.count[j])
+        at -= node->u.in.count[j++];
+
+    rows_node *split = rows_insert_at(rows_own(&node->u.in.child[j]), at, row);
+    node->u.in.count[j]++;
+    if (split == NULL)
+        return NULL;
+
+    node->u.in.count[j] = rows_node_count(node->u.in.child[j]);
+    int splitcount = rows_node_count(split);
+
+    if (node->n == ROWS_NODE_MAX)
+    {
+        right = rows_split(node);
+        if (j >= node->n)
+        {
+            j -= node->n;
+            target = right;
+        }
+    }
+    memmove(&target->u.in.child[j + 2], &target->u.in.child[j + 1], sizeof(rows_node *) * (target->n - j - 1));
+    memmove(&target->u.in.count[j + 2], &target->u.in.count[j + 1], sizeof(int) * (target->n - j - 1));
+    target->u.in.child[j + 1] = split;
+    target->u.in.count[j + 1] = splitcount;
+    target->n++;
+    return right;
+}
+
+/**
+ * Insert a row so that it becomes line number at
+ */
+void rows_insert(int at, erow *row)
+{
+    rows_node *split = rows_insert_at(rows_own(&E.rows), at, row);
+    if (split)
+    {
+        // Root split, grow the tree by one level
+        rows_node *root = rows_node_new(E.rows->height + 1);
+        root->u.in.child[0] = E.rows;
+        root->u.in.count[0] = rows_node_count(E.rows);
+        root->u.in.child[1] = split;
+        root->u.in.count[1] = rows_node_count(split);
+        root->n = 2;
+        E.rows = root;
+    }
+    E.rows_hint = NULL;
+}
+
+/**
+ * Hang an empty leaf off the right edge below node, returns the new
+ * right sibling if node was full
+ */
+rows_node *rows_append_leaf(rows_node *node, rows_node *leaf)
+{
+    rows_node *child = leaf;
+    if (node->height > 1)
+    {
+        child = rows_append_leaf(node->u.in.child[node->n - 1], leaf);
+        if (child == NULL)
+            return NULL;
+    }
+
+    // Appending only ever adds on the right, so a full node is left full
+    // and the new child starts a sibling instead of splitting it in half
+    rows_node *target = node;
+    if (node->n == ROWS_NODE_MAX)
+        target = rows_node_new(node->height);
+    target->u.in.child[target->n] = child;
+    target->u.in.count[target->n] = 0;
+    target->n++;
+    return target == node ? NULL : target;
+}
+
+/**
+ * Append n rows at the end of the buffer, topping up the last leaf
+ * before starting new ones
+ */
+void rows_append(erow *rows, int n)
+{
+    while (n > 0)
+    {
+        rows_node *last = rows_own(&E.rows);
+        while (last->height)
+            last = rows_own(&last->u.in.child[last->n - 1]);
+
+        if (last->n == ROWS_LEAF_MAX)
+        {
+            rows_node *leaf = rows_node_new(0);
+            leaf->prev = last;
+            last->next = leaf;
+            rows_node *split = leaf;
+            if (E.rows->height)
+                split = rows_append_leaf(E.rows, leaf);
+            if (split)
+            {
+                // Root was full, grow the tree by one level
+                rows_node *root = rows_node_new(E.rows->height + 1);
+                root->u.in.child[0] = E.rows;
+                root->u.in.count[0] = rows_node_count(E.rows);
+                root->u.in.child[1] = split;
+                root->u.in.count[1] = 0;
+                root->n = 2;
+                E.rows = root;
+            }
+            continue;
+        }
+
+        int m = ROWS_LEAF_MAX - last->n;
+        if (m > n)
+            m = n;
+        memcpy(&last->u.rows[last->n], rows, sizeof(erow) * m);
+        last->n += m;
+        rows_node *node;
+        for (node = E.rows; node->height; node = node->u.in.child[node->n - 1])
+            node->u.in.count[node->n - 1] += m;
+        E.numrows += m;
+        rows += m;
+        n -= m;
+    }
+}
+
+/**
+ * Merge child j of node into a neighbour once it is a quarter full
+ */
+void rows_rebalance(rows_node *node, int j)
+{
+    rows_node *child = node->u.in.child[j];
+    int max = child->height ? ROWS_NODE_MAX : ROWS_LEAF_MAX;
+    if (child->n > max / 4 || node->n < 2)
+        return;
+
+    // Merge the pair (l, l+1), preferring the left neighbour
+    int l = j > 0 ? j - 1 : j;
+    if (node->u.in.child[l]->n + node->u.in.child[l + 1]->n > max)
+        return;
+    rows_node *a = rows_own(&node->u.in.child[l]);
+    rows_node *b = rows_own(&node->u.in.child[l + 1]);
+
+    if (a->height == 0)
+    {
+        memcpy(&a->u.rows[a->n], b->u.rows, sizeof(erow) * b->n);
+        a->next = b->next;
+        if (b->next)
+            b->next->prev = a;
+    }
+    else
+    {
+        memcpy(&a->u.in.child[a->n], b->u.in.child, sizeof(rows_node *) * b->n);
+        memcpy(&a->u.in.count[a->n], b->u.in.count, sizeof(int) * b->n);
+    }
+    a->n += b->n;
+    node->u.in.count[l] += node->u.in.count[l + 1];
+    free(b);
+
+    memmove(&node->u.in.child[l + 1], &node->u.in.child[l + 2], sizeof(rows_node *) * (node->n - l - 2));
+    memmove(&node->u.in.count[l + 1], &node->u.in.count[l + 2], sizeof(int) * (node->n - l - 2));
+    node->n--;
+}
+
+/**
+ * Remove the row at line number at from below node
+ */
+void rows_delete_at(rows_node *node, int at)
+{
+    if (node->height == 0)
+    {
+        memmove(&node->u.rows[at], &node->u.rows[at + 1], sizeof(erow) * (node->n - at - 1));
+        node->n--;
+        return;
+    }
+
+    int j = 0;
+    while (j < node->n - 1 && at >= node->u.in.count[j])
+        at -= node->u.in.count[j++];
+
+    rows_delete_at(rows_own(&node->u.in.child[j]), at);
+    node->u.in.count[j]--;
+    rows_rebalance(node, j);
+}
+
+/**
+ * Remove the row at line number at (its memory is not freed)
+ */
+void rows_delete(int at)
+{
+    rows_delete_at(rows_own(&E.rows), at);
+    // Drop roots left with a single child
+    while (E.rows->height && E.rows->n == 1)
+    {
+        rows_node *old = E.rows;
+        E.rows = old->u.in.child[0];
+        free(old);
+    }
+    E.rows_hint = NULL;
+}
+
+/**
+ * Drop a tree's hold on a node, freeing it and everything below it once
+ * no tree holds it. Row text is left alone
+ */
+void rows_node_free(rows_node *node)
+{
+    if (--node->refs > 0)
+        return;
+    int j;
+    if (node->height)
+    {
+        for (j = 0; j < node->n; j++)
+            rows_node_free(node->u.in.child[j]);
+    }
+    free(node);
+}
+
+/**
+ * Cut the leaf holding line number at in two, so that a leaf starts there
+ */
+void rows_cut(int at)
+{
+    if (at <= 0 || at >= E.numrows)
+        return;
+    editor_row(at);
+    rows_node *leaf = E.rows_hint;
+    int from = at - E.rows_hint_base;
+    if (from == 0)
+        return;
+
+    // Take the rows from at on off the counts down to the leaf, then
+    // put them back in a leaf of their own
+    int moved = leaf->n - from;
+    rows_node *node = E.rows;
+    int base = 0;
+    while (node->height)
+    {
+        int j = 0;
+        while (j < node->n - 1 && at - base >= node->u.in.count[j])
+            base += node->u.in.count[j++];
+        node->u.in.count[j] -= moved;
+        node = node->u.in.child[j];
+    }
+    rows_node *right = rows_node_new(0);
+    memcpy(right->u.rows, &leaf->u.rows[from], sizeof(erow) * moved);
+    right->n = moved;
+    leaf->n = from;
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next)
+        leaf->next->prev = right;
+    leaf->next = right;
+    E.rows_hint = NULL;
+    rows_graft(at, right);
+}
+
+/**
+ * Insert a leaf below node so its rows start at line number at, where
+ * a leaf has to start or end. Returns the new right sibling if node had
+ * to split
+ */
+rows_node *rows_graft_at(rows_node *node, int at, rows_node *leaf)
+{
+    int j = 0;
+    while (j < node->n - 1 && at > node->u.in.count[j])
+        at -= node->u.in.count[j++];
+
+    // Leaves go in before or after child j, anything higher up goes
+    // after the child it split off from
+    rows_node *child = leaf;
+    int pos = at == 0 ? j : j + 1;
+    if (node->height > 1)
+    {
+        child = rows_graft_at(rows_own(&node->u.in.child[j]), at, leaf);
+        node->u.in.count[j] += leaf->n;
+        if (child == NULL)
+            return NULL;
+        node->u.in.count[j] = rows_node_count(node->u.in.child[j]);
+        pos = j + 1;
+    }
+
+    rows_node *right = NULL;
+    rows_node *target = node;
+    if (node->n == ROWS_NODE_MAX)
+    {
+        right = rows_split(node);
+        if (pos > node->n)
+        {
+            pos -= node->n;
+            target = right;
+        }
+    }
+    memmove(&target->u.in.child[pos + 1], &target->u.in.child[pos], sizeof(rows_node *) * (target->n - pos));
+    memmove(&target->u.in.count[pos + 1], &target->u.in.count[pos], sizeof(int) * (target->n - pos));
+    target->u.in.child[pos] = child;
+    target->u.in.count[pos] = rows_node_count(child);
+    target->n++;
+    return right;
+}
+
+/**
+ * Insert a leaf, already linked in with its neighbours, so its rows
+ * start at line number at
+ */
+void rows_graft(int at, rows_node *leaf)
+{
+    rows_node *split = leaf;
+    if (E.rows->height > 0)
+        split = rows_graft_at(rows_own(&E.rows), at, leaf);
+    else if (E.rows->n == 0)
+    {
+        // Empty buffer, the leaf takes the place of the empty root
+        rows_node_free(E.rows);
+        E.rows = leaf;
+        split = NULL;
+    }
+    else if (at == 0)
+    {
+        // Single leaf root, the new one goes in front of it
+        split = E.rows;
+        E.rows = leaf;
+    }
+    if (split)
+    {
+        // Root split, or a leaf root got a neighbour
+        rows_node *root = rows_node_new(E.rows->height + 1);
+        root->u.in.child[0] = E.rows;
+        root->u.in.count[0] = rows_node_count(E.rows);
+        root->u.in.child[1] = split;
+        root->u.in.count[1] = rows_node_count(split);
+        root->n = 2;
+        E.rows = root;
+    }
+    E.rows_hint = NULL;
+}
+
+/**
+ * Insert k rows so the first becomes line number at. The leaf there is
+ * cut in two and the rows go in between as whole leaves, one tree walk
+ * per leaf rather than per row
+ */
+void rows_insert_range(int at, erow *rows, int k)
+{
+    if (k < ROWS_LEAF_MAX / 2)
+    {
+        int j;
+        for (j = 0; j < k; j++)
+            rows_insert(at + j, &rows[j]);
+        return;
+    }
+
+    rows_cut(at);
+    // New leaves are chained in after the row before at
+    rows_node *prev = NULL;
+    if (at > 0)
+    {
+        editor_row(at - 1);
+        prev = E.rows_hint;
+    }
+    rows_node *next = prev ? prev->next : NULL;
+    if (prev == NULL)
+    {
+        for (next = E.rows; next->height; next = next->u.in.child[0])
+            ;
+        // The empty leaf of an empty buffer is replaced, see rows_graft
+        if (next->n == 0)
+            next = NULL;
+    }
+
+    int done = 0;
+    while (done < k)
+    {
+        rows_node *leaf = rows_node_new(0);
+        leaf->n = k - done < ROWS_LEAF_MAX ? k - done : ROWS_LEAF_MAX;
+        memcpy(leaf->u.rows, &rows[done], sizeof(erow) * leaf->n);
+        leaf->prev = prev;
+        leaf->next = next;
+        if (prev)
+            prev->next = leaf;
+        if (next)
+            next->prev = leaf;
+        rows_graft(at + done, leaf);
+        done += leaf->n;
+        prev = leaf;
+    }
+}
+
+/**
+ * Remove rows [at, at + k) from below node, freeing the nodes left
+ * empty (but not row text)
+ */
+void rows_delete_range_at(rows_node *node, int at, int k)
+{
+    if (node->height == 0)
+    {
+        memmove(&node->u.rows[at], &node->u.rows[at + k], sizeof(erow) * (node->n - at - k));
+        node->n -= k;
+        return;
+    }
+
+    int j = 0;
+    while (j < node->n - 1 && at >= node->u.in.count[j])
+        at -= node->u.in.count[j++];
+
+    // Children entirely inside the range go whole, the ones at its
+    // ends lose part of their rows
+    int first = j;
+    while (k > 0)
+    {
+        int take = node->u.in.count[j] - at;
+        if (take > k)
+            take = k;
+        if (at == 0 && take == node->u.in.count[j])
+        {
+            rows_node_free(node->u.in.child[j]);
+            memmove(&node->u.in.child[j], &node->u.in.child[j + 1], sizeof(rows_node *) * (node->n - j - 1));
+            memmove(&node->u.in.count[j], &node->u.in.count[j + 1], sizeof(int) * (node->n - j - 1));
+            node->n--;
+        }
+        else
+        {
+            rows_delete_range_at(rows_own(&node->u.in.child[j]), at, take);
+            node->u.in.count[j] -= take;
+            j++;
+        }
+        k -= take;
+        at = 0;
+    }
+
+    // Merge what is left either side of the cut into its neighbours
+    if (first + 1 < node->n)
+        rows_rebalance(node, first + 1);
+    if (first < node->n)
+        rows_rebalance(node, first);
+}
+
+/**
+ * Remove k rows starting at line number at (their memory is not freed)
+ */
+void rows_delete_range(int at, int k)
+{
+    if (k < ROWS_LEAF_MAX / 2)
+    {
+        while (k--)
+            rows_delete(at);
+        return;
+    }
+
+    // Chain the leaves either side of the range, the ones in between go
+    rows_node *prev = NULL;
+    rows_node *next = NULL;
+    if (at > 0)
+    {
+        editor_row(at - 1);
+        prev = E.rows_hint;
+    }
+    if (at + k < E.numrows)
+    {
+        editor_row(at + k);
+        next = E.rows_hint;
+    }
+    if (prev != next)
+    {
+        if (prev)
+            prev->next = next;
+        if (next)
+            next->prev = prev;
+    }
+
+    rows_delete_range_at(rows_own(&E.rows), at, k);
+    if (E.rows->height && E.rows->n == 0)
+    {
+        // Everything went
+        free(E.rows);
+        E.rows = rows_node_new(0);
+    }
+    // Drop roots left with a single child
+    while (E.rows->height && E.rows->n == 1)
+    {
+        rows_node *old = E.rows;
+        E.rows = old->u.in.child[0];
+        free(old);
+    }
+    // A leaf root has no neighbours, whatever it was chained to went
+    if (E.rows->height == 0)
+        E.rows->prev = E.rows->next = NULL;
+    E.rows_hint = NULL;
+}
+
+/**
+ * Drop every row of the buffer. Their text goes a block at a time with
+ * the arena, rows are never visited
+ */
+void editor_free_rows()
+{
+    // The writer may still be reading row text
+    editor_finish_save(true);
+    rows_node_free(E.rows);
+    E.rows = rows_node_new(0);
+    E.rows_hint = NULL;
+    E.numrows = 0;
+
+    int j;
+    for (j = 0; j < E.nlines; j++)
+    {
+        struct long_line *ll = E.lines[j];
+        if (ll == NULL)
+            continue;
+        free(ll->chunks);
+        free(ll->pos);
+        free(ll->rx);
+        free(ll);
+        E.lines[j] = NULL;
+    }
+    E.nlong = 0;
+    text_release();
+}
+
+/**
+ * Move text out of blocks that are mostly dead so they can be released.
+ * Runs for MIM_TEXT_BUDGET ms at a time, picking up where it stopped
+ */
+void editor_text_compact()
+{
+    struct text_arena *t = &E.text;
+    if (!t->compacting || E.save)
+        return;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int n = 0;
+    while (t->compact_row < E.numrows)
+    {
+        erow *row = editor_row(t->compact_row++);
+        if (!(row->flags & (ROW_BIG | ROW_INLINE)))
+        {
+            struct text_block *b = t->table[row->u.ref >> MIM_TEXT_UNIT_BITS];
+            // Slack for growing the row goes, it gets it back when edited.
+            // Rows deleted down to a few bytes move into the row itself
+            if ((b != t->blocks && b->live * 2 < b->chunks) || row->size < MIM_ROW_INLINE)
+            {
+                // The copy of a long row has no room for its gap
+                editor_row_close_gap(row);
+                editor_row_resize(row, row->size + 1, row->size + 1);
+                if (row->flags & ROW_LONG)
+                    E.lines[row->slot]->gaplen = 0;
+            }
+        }
+
+        if (++n % 1024 == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (ms >= MIM_TEXT_BUDGET)
+                return;
+        }
+    }
+    t->compacting = false;
+    t->compact_row = 0;
+    t->dead_kept = t->dead;
+}
+
+/*** UNDO ***/
+
+/**
+ * Memory the journal holds, records and text
+ */
+size_t editor_undo_bytes()
+{
+    struct undo_log *u = &E.undo;
+    return (u->n - u->first) * sizeof(struct undo_rec) + u->textlen - u->textstart;
+}
+
+/**
+ * Start a new undo step with the next change
+ */
+void editor_undo_seal()
+{
+    struct undo_log *u = &E.undo;
+    // The step just recorded ends with the cursor where it is now
+    if (!u->seal && u->n > u->first)
+    {
+        u->recs[u->n - 1].acy = E.cy;
+        u->recs[u->n - 1].acx = E.cx;
+    }
+    u->seal = true;
+}
+
+/**
+ * Drop the oldest undo steps until the journal fits its limit
+ */
+void editor_undo_trim()
+{
+    struct undo_log *u = &E.undo;
+    while (editor_undo_bytes() > u->limit && u->first < u->n)
+    {
+        int j = u->first + 1;
+        while (j < u->n && !u->recs[j].start)
+            j++;
+        // The step being recorded is too big to keep at all
+        if (j == u->n && !u->seal)
+            u->dropping = true;
+        u->first = j;
+        u->textstart = j < u->n ? u->recs[j].off : u->textlen;
+        if (u->pos < u->first)
+            u->pos = u->first;
+    }
+
+    // Move what is left to the front once most of the arrays is dropped
+    if (u->first > 64 && u->first >= u->n / 2)
+    {
+        int j;
+        for (j = u->first; j < u->n; j++)
+            u->recs[j].off -= u->textstart;
+        memmove(u->recs, &u->recs[u->first], sizeof(struct undo_rec) * (u->n - u->first));
+        memmove(u->text, &u->text[u->textstart], u->textlen - u->textstart);
+        u->n -= u->first;
+        u->pos -= u->first;
+        u->first = 0;
+        u->textlen -= u->textstart;
+        u->textstart = 0;
+    }
+}
+
+/**
+ * Make room for len more bytes of journal text
+ */
+void editor_undo_reserve(size_t len)
+{
+    struct undo_log *u = &E.undo;
+    if (u->textlen + len <= u->textcap)
+        return;
+    size_t cap = u->textcap ? u->textcap * 2 : 4096;
+    while (cap < u->textlen + len)
+        cap *= 2;
+    u->text = xrealloc(u->text, cap);
+    u->textcap = cap;
+}
+
+/**
+ * Note a change to the buffer so it can be undone. s is the text
+ * inserted or removed, for UNDO_SET_ROW the old text and s2 the new
+ */
+void editor_undo_record(int type, int y, int x, const char *s, int len, const char *s2, int len2)
+{
+    struct undo_log *u = &E.undo;
+    if (u->applying)
+        return;
+
+    // Anything undone can't be redone once something else changes
+    bool truncated = u->pos < u->n;
+    if (truncated)
+    {
+        u->textlen = u->recs[u->pos].off;
+        u->n = u->pos;
+    }
+
+    // Typing and backspacing over a word extend the last record
+    if (len == 1 && !truncated && u->n > u->first)
+    {
+        struct undo_rec *last = &u->recs[u->n - 1];
+        char *text = &u->text[last->off];
+        if (last->typed && last->y == y && last->type == type && !u->dropping)
+        {
+            if (type == UNDO_INSERT && last->x + last->len == x &&
+                !(isspace((unsigned char)text[last->len - 1]) && !isspace((unsigned char)s[0])))
+            {
+                editor_undo_reserve(1);
+                u->text[u->textlen++] = s[0];
+                last->len++;
+                u->seal = false;
+                editor_undo_trim();
+                return;
+            }
+            if (type == UNDO_DELETE && x + 1 == last->x)
+            {
+                editor_undo_reserve(1);
+                text = &u->text[last->off];
+                memmove(text + 1, text, last->len);
+                text[0] = s[0];
+                u->textlen++;
+                last->len++;
+                last->x = x;
+                u->seal = false;
+                editor_undo_trim();
+                return;
+            }
+        }
+    }
+
+    bool start = u->seal;
+    u->seal = false;
+    if (start)
+        u->dropping = false;
+    else if (u->dropping)
+        return;
+
+    if (u->n == u->cap)
+    {
+        u->cap = u->cap ? u->cap * 2 : 256;
+        u->recs = xrealloc(u->recs, sizeof(struct undo_rec) * u->cap);
+    }
+    editor_undo_reserve(len + len2);
+
+    struct undo_rec *rec = &u->recs[u->n++];
+    rec->type = type;
+    rec->start = start;
+    rec->typed = len == 1 && len2 == 0 && (type == UNDO_INSERT || type == UNDO_DELETE);
+    rec->y = y;
+    rec->x = x;
+    rec->cy = E.cy;
+    rec->cx = E.cx;
+    rec->acy = E.cy;
+    rec->acx = E.cx;
+    rec->off = u->textlen;
+    rec->len = len;
+    rec->len2 = len2;
+    if (len)
+        memcpy(&u->text[u->textlen], s, len);
+    u->textlen += len;
+    if (len2)
+        memcpy(&u->text[u->textlen], s2, len2);
+    u->textlen += len2;
+    u->pos = u->n;
+    editor_undo_trim();
+}
+
+/**
+ * Note a change to the buffer for undo and the recovery journal
+ */
+void editor_note_change(int type, int y, int x, const char *s, int len, const char *s2, int len2)
+{
+    // Undo and redo are changes too as far as recovery is concerned
+    editor_journal_record(type, y, x, s, len, s2, len2);
+    editor_undo_record(type, y, x, s, len, s2, len2);
+}
+
+/*** TABS ***/
+
+/**
+ * Render column after n bytes whose tabs are the set bits of mask
+ */
+int tab_mask_width(int rx, int n, unsigned mask)
+{
+    int prev = 0;
+    while (mask)
+    {
+        int bit = __builtin_ctz(mask);
+        rx += bit - prev;
+        rx += MIM_TAB_SIZE - rx % MIM_TAB_SIZE;
+        prev = bit + 1;
+        mask &= mask - 1;
+    }
+    return rx + n - prev;
+}
+
+/**
+ * Render n bytes whose tabs are the set bits of mask
+ */
+int tab_mask_render(char *render, int rx, const char *p, int n, unsigned mask)
+{
+    // Runs between tabs are short when there are tabs at all, so bytes
+    // are moved one at a time rather than through memcpy calls
+    int j = 0;
+    while (mask)
+    {
+        int bit = __builtin_ctz(mask);
+        while (j < bit)
+            render[rx++] = p[j++];
+        render[rx++] = ' ';
+        while (rx % MIM_TAB_SIZE != 0)
+            render[rx++] = ' ';
+        j++;
+        mask &= mask - 1;
+    }
+    while (j < n)
+        render[rx++] = p[j++];
+    return rx;
+}
+
+int tab_find_scalar(const char *s, int len)
+{
+    int j;
+    for (j = 0; j < len; j++)
+    {
+        if (s[j] == '\t')
+            break;
+    }
+    return j;
+}
+
+int tab_width_scalar(const char *s, int len, int rx)
+{
+    int j;
+    for (j = 0; j < len; j++)
+    {
+        if (s[j] == '\t')
+            rx += (MIM_TAB_SIZE - 1) - (rx % MIM_TAB_SIZE);
+        rx++;
+    }
+    return rx;
+}
+
+int tab_render_scalar(char *render, int rx, const char *s, int len)
+{
+    int j;
+    for (j = 0; j < len; j++)
+    {
+        if (s[j] == '\t')
+        {
+            render[rx++] = ' ';
+            // Append spaces until tabsize is hit
+            while (rx % MIM_TAB_SIZE != 0)
+                render[rx++] = ' ';
+        }
+        else
+        {
+            render[rx++] = s[j];
+        }
+    }
+    return rx;
+}
+
+#ifdef __SSE2__
+// 16 bytes at a time, a block without tabs is a plain copy or add. The
+// tail under 16 bytes goes to the scalar loops. Rendering a block one
+// tab at a time loses to the scalar loop once tabs are spread through
+// the text, as in tab separated columns, so only tabs indenting the
+// start of a block are rendered from the mask. Anything denser hands
+// the rest of the row to the scalar loop
+
+int tab_find_sse2(const char *s, int len)
+{
+    __m128i tab = _mm_set1_epi8('\t');
+    int j;
+    for (j = 0; j + 16 <= len; j += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&s[j]), tab));
+        if (mask)
+            return j + __builtin_ctz(mask);
+    }
+    return j + tab_find_scalar(&s[j], len - j);
+}
+
+int tab_width_sse2(const char *s, int len, int rx)
+{
+    __m128i tab = _mm_set1_epi8('\t');
+    int j;
+    for (j = 0; j + 16 <= len; j += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&s[j]), tab));
+        rx = mask ? tab_mask_width(rx, 16, mask) : rx + 16;
+    }
+    return tab_width_scalar(&s[j], len - j, rx);
+}
+
+int tab_render_sse2(char *render, int rx, const char *s, int len)
+{
+    __m128i tab = _mm_set1_epi8('\t');
+    int j;
+    for (j = 0; j + 16 <= len; j += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[j]);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+        if (mask & (mask + 1))
+            return tab_render_scalar(render, rx, &s[j], len - j);
+        if (mask)
+        {
+            rx = tab_mask_render(render, rx, &s[j], 16, mask);
+            continue;
+        }
+        _mm_storeu_si128((__m128i *)&render[rx], v);
+        rx += 16;
+    }
+    return tab_render_scalar(render, rx, &s[j], len - j);
+}
+#endif
+
+#ifdef MIM_AVX2
+// Same as the SSE2 kernels 32 bytes at a time, plus one 16 byte block
+// for the tail. Built for AVX2 whatever the compiler flags so one binary
+// runs everywhere, and kept apart from the SSE2 code as mixing the two
+// encodings stalls some CPUs
+
+__attribute__((target("avx2"))) int tab_find_avx2(const char *s, int len)
+{
+    __m256i tab = _mm256_set1_epi8('\t');
+    unsigned mask;
+    int j;
+    for (j = 0; j + 32 <= len; j += 32)
+    {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&s[j]), tab));
+        if (mask)
+            return j + __builtin_ctz(mask);
+    }
+    if (j + 16 <= len)
+    {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&s[j]), _mm256_castsi256_si128(tab)));
+        if (mask)
+            return j + __builtin_ctz(mask);
+        j += 16;
+    }
+    return j + tab_find_scalar(&s[j], len - j);
+}
+
+__attribute__((target("avx2"))) int tab_width_avx2(const char *s, int len, int rx)
+{
+    __m256i tab = _mm256_set1_epi8('\t');
+    unsigned mask;
+    int j;
+    for (j = 0; j + 32 <= len; j += 32)
+    {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&s[j]), tab));
+        rx = mask ? tab_mask_width(rx, 32, mask) : rx + 32;
+    }
+    if (j + 16 <= len)
+    {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&s[j]), _mm256_castsi256_si128(tab)));
+        rx = mask ? tab_mask_width(rx, 16, mask) : rx + 16;
+        j += 16;
+    }
+    return tab_width_scalar(&s[j], len - j, rx);
+}
+
+__attribute__((target("avx2"))) int tab_render_avx2(char *render, int rx, const char *s, int len)
+{
+    __m256i tab = _mm256_set1_epi8('\t');
+    unsigned mask;
+    int j;
+    for (j = 0; j + 32 <= len; j += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&s[j]);
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab));
+        if (mask & (mask + 1))
+            return tab_render_scalar(render, rx, &s[j], len - j);
+        if (mask)
+        {
+            rx = tab_mask_render(render, rx, &s[j], 32, mask);
+            continue;
+        }
+        _mm256_storeu_si256((__m256i *)&render[rx], v);
+        rx += 32;
+    }
+    if (j + 16 <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[j]);
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm256_castsi256_si128(tab)));
+        if (mask & (mask + 1))
+            return tab_render_scalar(render, rx, &s[j], len - j);
+        if (mask)
+        {
+            rx = tab_mask_render(render, rx, &s[j], 16, mask);
+        }
+        else
+        {
+            _mm_storeu_si128((__m128i *)&render[rx], v);
+            rx += 16;
+        }
+        j += 16;
+    }
+    return tab_render_scalar(render, rx, &s[j], len - j);
+}
+#endif
+
+// From slowest to fastest
+const struct tab_kernels tab_kernels[] = {
+    {"scalar", NULL, tab_find_scalar, tab_width_scalar, tab_render_scalar},
+#ifdef __SSE2__
+    {"sse2", NULL, tab_find_sse2, tab_width_sse2, tab_render_sse2},
+#endif
+#ifdef MIM_AVX2
+    {"avx2", "avx2", tab_find_avx2, tab_width_avx2, tab_render_avx2},
+#endif
+};
+const int tab_nkernels = sizeof(tab_kernels) / sizeof(tab_kernels[0]);
+
+/**
+ * Whether the CPU can run a set of tab kernels
+ */
+bool editor_tab_supported(const struct tab_kernels *k)
+{
+#ifdef MIM_AVX2
+    if (k->cpu && strcmp(k->cpu, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return k->cpu == NULL;
+}
+
+/**
+ * Pick the fastest tab kernels the CPU supports
+ */
+void editor_tab_init()
+{
+    int j;
+    for (j = 0; j < tab_nkernels; j++)
+    {
+        if (editor_tab_supported(&tab_kernels[j]))
+            E.tabs = &tab_kernels[j];
+    }
+}
+
+/*** LONG LINES ***/
+
+/**
+ * Render column after a chunk, starting at column rx
+ */
+int editor_chunk_rx(struct line_chunk *c, int rx)
+{
+    if (c->post < 0)
+        return rx + c->len;
+    // The first tab lands on a tab stop whatever came before it
+    rx += c->pre;
+    return rx + MIM_TAB_SIZE - rx % MIM_TAB_SIZE + c->post;
+}
+
+/**
+ * Text of a long row at offset at, and how much of it is contiguous
+ * up to the gap or the end
+ */
+char *editor_long_text(erow *row, struct long_line *ll, int at, int *avail)
+{
+    char *chars = editor_row_chars(row);
+    if (at < ll->gap)
+    {
+        *avail = ll->gap - at;
+        return chars + at;
+    }
+    *avail = row->size - at;
+    return chars + at + ll->gaplen;
+}
+
+/**
+ * Summarize the c->len bytes of a long row starting at offset at
+ */
+void editor_chunk_scan(erow *row, struct long_line *ll, int at, struct line_chunk *c)
+{
+    c->pre = c->len;
+    c->post = -1;
+    int rx = 0;
+    int done = 0;
+    while (done < c->len)
+    {
+        int avail;
+        char *p = editor_long_text(row, ll, at + done, &avail);
+        if (avail > c->len - done)
+            avail = c->len - done;
+        int j = 0;
+        if (c->post < 0)
+        {
+            j = E.tabs->find(p, avail);
+            if (j < avail)
+            {
+                // Columns are counted from the first tab stop on
+                c->pre = done + j;
+                c->post = 0;
+                j++;
+            }
+        }
+        if (c->post >= 0)
+            rx = E.tabs->width(&p[j], avail - j, rx);
+        done += avail;
+    }
+    if (c->post >= 0)
+        c->post = rx;
+}
+
+/**
+ * Make room for n chunks in a long row's index
+ */
+void editor_long_grow(struct long_line *ll, int n)
+{
+    if (n <= ll->chunkscap)
+        return;
+    ll->chunkscap = n > ll->chunkscap * 2 ? n : ll->chunkscap * 2;
+    ll->chunks = xrealloc(ll->chunks, sizeof(struct line_chunk) * ll->chunkscap);
+    ll->pos = xrealloc(ll->pos, sizeof(int) * (ll->chunkscap + 1));
+    ll->rx = xrealloc(ll->rx, sizeof(int) * (ll->chunkscap + 1));
+}
+
+/**
+ * Cut chunk k, which starts at a known offset, into MIM_LONG_CHUNK pieces
+ */
+void editor_long_split(erow *row, struct long_line *ll, int k)
+{
+    int len = ll->chunks[k].len;
+    int n = len ? (len + MIM_LONG_CHUNK - 1) / MIM_LONG_CHUNK : 1;
+    editor_long_grow(ll, ll->nchunks + n - 1);
+    memmove(&ll->chunks[k + n], &ll->chunks[k + 1], sizeof(struct line_chunk) * (ll->nchunks - k - 1));
+    ll->nchunks += n - 1;
+
+    int j;
+    for (j = 0; j < n; j++)
+    {
+        struct line_chunk *c = &ll->chunks[k + j];
+        c->len = len - j * MIM_LONG_CHUNK < MIM_LONG_CHUNK ? len - j * MIM_LONG_CHUNK : MIM_LONG_CHUNK;
+        editor_chunk_scan(row, ll, ll->pos[k] + j * MIM_LONG_CHUNK, c);
+    }
+}
+
+/**
+ * Gap and index of a long row, built the first time the row is seen long.
+ * Callers check editor_row_long first, so there is an entry free for it
+ */
+struct long_line *editor_long_line(erow *row)
+{
+    if (row->flags & ROW_LONG)
+        return E.lines[row->slot];
+
+    int idx = 0;
+    while (idx < E.nlines && E.lines[idx])
+        idx++;
+    if (idx == E.nlines)
+    {
+        E.nlines = E.nlines ? E.nlines * 2 : 8;
+        E.lines = xrealloc(E.lines, sizeof(struct long_line *) * E.nlines);
+        memset(&E.lines[idx], 0, sizeof(struct long_line *) * (E.nlines - idx));
+    }
+
+    struct long_line *ll = xcalloc(1, sizeof(struct long_line));
+    ll->gap = row->size;
+    editor_long_grow(ll, 1);
+    ll->nchunks = 1;
+    ll->chunks[0].len = row->size;
+    ll->pos[0] = 0;
+    ll->rx[0] = 0;
+    editor_long_split(row, ll, 0);
+
+    E.lines[idx] = ll;
+    E.nlong++;
+    row->flags |= ROW_LONG;
+    row->slot = idx;
+    return ll;
+}
+
+/**
+ * Drop the gap and index of a row whose chars are being replaced or freed
+ */
+void editor_long_free(erow *row)
+{
+    struct long_line *ll = E.lines[row->slot];
+    free(ll->chunks);
+    free(ll->pos);
+    free(ll->rx);
+    free(ll);
+    E.lines[row->slot] = NULL;
+    E.nlong--;
+    row->flags &= ~ROW_LONG;
+}
+
+/**
+ * Whether a row that is size bytes long is kept as a long row, see
+ * editor_long_line
+ */
+bool editor_row_long(erow *row, int size)
+{
+    if (row->flags & ROW_LONG)
+        return true;
+    return size >= MIM_LONG_LINE && E.nlong < MIM_LONG_SLOTS;
+}
+
+/**
+ * Work out where chunks start, up to chunk k
+ */
+void editor_long_extend(struct long_line *ll, int k)
+{
+    while (ll->valid < k)
+    {
+        struct line_chunk *c = &ll->chunks[ll->valid];
+        ll->pos[ll->valid + 1] = ll->pos[ll->valid] + c->len;
+        ll->rx[ll->valid + 1] = editor_chunk_rx(c, ll->rx[ll->valid]);
+        ll->valid++;
+    }
+}
+
+/**
+ * Chunk holding offset at of a long row, the last one for the end
+ */
+int editor_long_chunk(struct long_line *ll, int at)
+{
+    while (ll->valid < ll->nchunks - 1 && ll->pos[ll->valid] + ll->chunks[ll->valid].len <= at)
+        editor_long_extend(ll, ll->valid + 1);
+    if (at >= ll->pos[ll->valid])
+        return ll->valid;
+
+    // Already known, binary search for the last chunk starting at or before at
+    int lo = 0, hi = ll->valid;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (ll->pos[mid] <= at)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/**
+ * Chunk holding render column rx of a long row
+ */
+int editor_long_chunk_rx(struct long_line *ll, int rx)
+{
+    while (ll->valid < ll->nchunks - 1 && editor_chunk_rx(&ll->chunks[ll->valid], ll->rx[ll->valid]) <= rx)
+        editor_long_extend(ll, ll->valid + 1);
+    if (rx >= ll->rx[ll->valid])
+        return ll->valid;
+
+    int lo = 0, hi = ll->valid;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (ll->rx[mid] <= rx)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/**
+ * Convert cursor x position to render x position on a long row,
+ * walking only the chunk cx is in
+ */
+int editor_long_cx_to_rx(erow *row, int cx)
+{
+    struct long_line *ll = editor_long_line(row);
+    int k = editor_long_chunk(ll, cx);
+    int rx = ll->rx[k];
+    int at = ll->pos[k];
+    while (at < cx)
+    {
+        int avail;
+        char *p = editor_long_text(row, ll, at, &avail);
+        if (avail > cx - at)
+            avail = cx - at;
+        rx = E.tabs->width(p, avail, rx);
+        at += avail;
+    }
+    return rx;
+}
+
+/**
+ * Append the part of a long row from render column coloff on that fits
+ * in width columns
+ */
+void editor_long_draw(erow *row, struct abuf *line, int coloff, int width)
+{
+    struct long_line *ll = editor_long_line(row);
+    int k = editor_long_chunk_rx(ll, coloff);
+    int rx = ll->rx[k];
+    int at = ll->pos[k];
+    int end = coloff + width;
+    while (at < row->size && rx < end)
+    {
+        int avail;
+        char *p = editor_long_text(row, ll, at, &avail);
+        int j = 0;
+        while (j < avail && rx < end)
+        {
+            // Copy the run up to the next tab in one go, clipped to the screen
+            int run = E.tabs->find(&p[j], avail - j);
+            if (run > end - rx)
+                run = end - rx;
+            int skip = rx < coloff ? coloff - rx : 0;
+            if (skip < run)
+                ab_append(line, &p[j + skip], run - skip);
+            rx += run;
+            j += run;
+            if (j == avail || rx >= end)
+                break;
+            int pad = MIM_TAB_SIZE - rx % MIM_TAB_SIZE;
+            int from = rx < coloff ? coloff : rx;
+            int to = rx + pad < end ? rx + pad : end;
+            if (from < to)
+                ab_fill(line, ' ', to - from);
+            rx += pad;
+            j++;
+        }
+        at += j;
+    }
+}
+
+/**
+ * Move the gap of a long row to offset at
+ */
+void editor_long_move_gap(erow *row, struct long_line *ll, int at)
+{
+    char *chars = editor_row_chars(row);
+    if (at < ll->gap)
+        memmove(chars + at + ll->gaplen, chars + at, ll->gap - at);
+    else if (at > ll->gap)
+        memmove(chars + ll->gap, chars + ll->gap + ll->gaplen, at - ll->gap);
+    ll->gap = at;
+}
+
+/**
+ * Make a row's text contiguous, for code that reads chars directly
+ */
+void editor_row_close_gap(erow *row)
+{
+    // View rows are never edited, so their gap is always empty, and
+    // their chars can't be written to
+    if (!(row->flags & ROW_LONG) || (row->flags & ROW_VIEW))
+        return;
+    // A save may be writing the text either side of the gap
+    editor_row_unshare(row);
+    editor_long_move_gap(row, E.lines[row->slot], row->size);
+    editor_row_chars(row)[row->size] = '\0';
+}
+
+/**
+ * Make every row's text contiguous
+ */
+void editor_close_gaps()
+{
+    int j;
+    for (j = 0; j < E.nlines && !E.lines[j]; j++)
+        ;
+    if (j == E.nlines || E.map)
+        return;
+    for (j = 0; j < E.numrows; j++)
+        editor_row_close_gap(editor_row(j));
+}
+
+/**
+ * Insert text into a long row, at the gap so typing in one place doesn't
+ * move the rest of the row
+ */
+void editor_long_insert(erow *row, int at, char *s, int len)
+{
+    struct long_line *ll = editor_long_line(row);
+    int k = editor_long_chunk(ll, at);
+
+    editor_long_move_gap(row, ll, at);
+    if (ll->gaplen < len)
+    {
+        // Grow geometrically, the text after the gap only moves then
+        int gaplen = len + row->size / 8 + MIM_LONG_CHUNK;
+        editor_row_resize(row, row->size + gaplen + 1, row->size + ll->gaplen + 1);
+        char *chars = editor_row_chars(row);
+        memmove(chars + at + gaplen, chars + at + ll->gaplen, row->size - at);
+        ll->gaplen = gaplen;
+    }
+    memcpy(editor_row_chars(row) + at, s, len);
+    ll->gap += len;
+    ll->gaplen -= len;
+    row->size += len;
+
+    // Only the chunk the text went into changes, the ones after it move
+    ll->chunks[k].len += len;
+    ll->valid = k;
+    if (ll->chunks[k].len > 2 * MIM_LONG_CHUNK)
+        editor_long_split(row, ll, k);
+    else
+        editor_chunk_scan(row, ll, ll->pos[k], &ll->chunks[k]);
+}
+
+/**
+ * Delete len bytes at the gap of a long row, moved to at beforehand
+ */
+void editor_long_delete(erow *row, struct long_line *ll, int at, int len)
+{
+    int k = editor_long_chunk(ll, at);
+    ll->gaplen += len;
+    row->size -= len;
+
+    // Take the bytes out of the chunks they were in, dropping emptied ones
+    int j = k;
+    int off = at - ll->pos[k];
+    int left = len;
+    while (left > 0)
+    {
+        int take = ll->chunks[j].len - off < left ? ll->chunks[j].len - off : left;
+        ll->chunks[j].len -= take;
+        left -= take;
+        off = 0;
+        j++;
+    }
+    int n = k;
+    int i;
+    for (i = k; i < j; i++)
+    {
+        if (ll->chunks[i].len)
+            ll->chunks[n++] = ll->chunks[i];
+    }
+    memmove(&ll->chunks[n], &ll->chunks[j], sizeof(struct line_chunk) * (ll->nchunks - j));
+    ll->nchunks -= j - n;
+    if (ll->nchunks == 0)
+        ll->nchunks = 1;
+
+    // The chunks either side of the deletion are summarized again
+    ll->valid = k < ll->nchunks ? k : ll->nchunks - 1;
+    struct line_chunk *c = &ll->chunks[ll->valid];
+    if (ll->nchunks == 1 && row->size == 0)
+        c->len = 0;
+    editor_chunk_scan(row, ll, ll->pos[ll->valid], c);
+    if (ll->valid + 1 < ll->nchunks)
+        editor_chunk_scan(row, ll, ll->pos[ll->valid] + c->len, c + 1);
+}
+
+/*** ROW OPERATIONS ***/
+
+/**
+ * Convert cursor x position to render x position accounting for tabs
+ */
+int editor_row_cx_to_rx(erow *row, int cx)
+{
+    if (editor_row_long(row, row->size))
+        return editor_long_cx_to_rx(row, cx);
+    return E.tabs->width(editor_row_chars(row), cx, 0);
+}
+
+/**
+ * Mark a row's render stale after its chars changed
+ */
+void editor_update_row(erow *row)
+{
+    // Re-rendered lazily the next time the row is drawn
+    row->flags &= ~(ROW_PLAIN | ROW_TABS);
+    row->gen = 0;
+}
+
+/**
+ * Move a render cache entry to the front of the LRU list
+ */
+void editor_render_touch(int idx)
+{
+    struct render_entry *entry = &E.render_cache[idx];
+    if (E.render_head == idx)
+        return;
+
+    // Unlink
+    E.render_cache[entry->prev].next = entry->next;
+    if (entry->next != -1)
+        E.render_cache[entry->next].prev = entry->prev;
+    else
+        E.render_tail = entry->prev;
+
+    // Relink at head
+    entry->prev = -1;
+    entry->next = E.render_head;
+    E.render_cache[E.render_head].prev = idx;
+    E.render_head = idx;
+}
+
+/**
+ * Get the text to draw for a row, expanding tabs only when it has any
+ */
+char *editor_row_render(erow *row, int *rsize)
+{
+    char *chars = editor_row_chars(row);
+    if (!(row->flags & (ROW_PLAIN | ROW_TABS)))
+        row->flags |= memchr(chars, '\t', row->size) ? ROW_TABS : ROW_PLAIN;
+
+    // Nothing to expand, draw straight from chars
+    if (row->flags & ROW_PLAIN)
+    {
+        *rsize = row->size;
+        return chars;
+    }
+
+    struct render_entry *entry;
+    if (row->gen != 0 && E.render_cache[row->slot].gen == row->gen)
+    {
+        entry = &E.render_cache[row->slot];
+        editor_render_touch(row->slot);
+        *rsize = entry->rsize;
+        return entry->render;
+    }
+
+    // Miss, reuse the least recently used entry
+    int idx = E.render_tail;
+    entry = &E.render_cache[idx];
+    editor_render_touch(idx);
+    if (++E.render_gen == 0)
+        E.render_gen = 1;
+    entry->gen = E.render_gen;
+    row->gen = entry->gen;
+    row->slot = idx;
+
+    int need = E.tabs->width(chars, row->size, 0) + 1;
+    if (need > entry->cap)
+    {
+        // Entries are reused for other rows, so grow geometrically
+        entry->cap = need > entry->cap * 2 ? need : entry->cap * 2;
+        free(entry->render);
+        entry->render = xmalloc(entry->cap);
+    }
+
+    int rx = E.tabs->render(entry->render, 0, chars, row->size);
+    entry->render[rx] = '\0';
+    entry->rsize = rx;
+
+    *rsize = entry->rsize;
+    return entry->render;
+}
+
+/**
+ * Render entry of a row if it is in the cache, NULL otherwise
+ */
+struct render_entry *editor_render_cached(erow *row)
+{
+    if (!(row->flags & ROW_TABS) || row->gen == 0 || E.render_cache[row->slot].gen != row->gen)
+        return NULL;
+    return &E.render_cache[row->slot];
+}
+
+/**
+ * Render columns len chars take when drawn from column rx
+ */
+int editor_render_width(const char *s, int len, int rx)
+{
+    return E.tabs->width(s, len, rx) - rx;
+}
+
+/**
+ * Bring a cached render up to date after chars[at, at + len) replaced
+ * text that was drawn in columns [rx, oldend). Only the columns up to
+ * the first tab where old and new text line up again are redone, the
+ * rest of the render is moved at most
+ */
+void editor_render_patch(erow *row, int at, int len, int rx, int oldend)
+{
+    struct render_entry *entry = &E.render_cache[row->slot];
+    char *chars = editor_row_chars(row);
+    int newrx = rx + editor_render_width(&chars[at], len, rx);
+    int oldrx = oldend;
+    int j = at + len;
+    while (newrx != oldrx && j < row->size)
+    {
+        if (chars[j] == '\t')
+        {
+            newrx += MIM_TAB_SIZE - newrx % MIM_TAB_SIZE;
+            oldrx += MIM_TAB_SIZE - oldrx % MIM_TAB_SIZE;
+        }
+        else
+        {
+            newrx++;
+            oldrx++;
+        }
+        j++;
+    }
+
+    int rsize = entry->rsize + newrx - oldrx;
+    if (rsize + 1 > entry->cap)
+    {
+        entry->cap = rsize + 1 > entry->cap * 2 ? rsize + 1 : entry->cap * 2;
+        entry->render = xrealloc(entry->render, entry->cap);
+    }
+    // Columns from oldrx on look the same, shifted if nothing realigned them
+    memmove(&entry->render[newrx], &entry->render[oldrx], entry->rsize - oldrx + 1);
+    E.tabs->render(entry->render, rx, &chars[at], j - at);
+    entry->rsize = rsize;
+}
+
+/**
+ * Give a row new text of cap bytes, its old text is already freed
+ */
+char *editor_row_alloc(erow *row, int cap)
+{
+    row->flags &= ~(ROW_PINNED | ROW_CAP | ROW_BIG | ROW_INLINE);
+    if (cap <= MIM_ROW_INLINE)
+    {
+        row->flags |= ROW_INLINE;
+        return row->u.text;
+    }
+    bool big;
+    char *p = text_alloc(cap, &row->u.ref, &big);
+    if (big)
+        row->flags |= ROW_BIG;
+    return p;
+}
+
+/**
+ * Fill in a fresh row holding a copy of s
+ */
+void editor_init_row(erow *row, char *s, size_t len)
+{
+    row->size = len;
+    // Rendering waits until the row is first drawn
+    row->flags = 0;
+    row->gen = 0;
+    char *chars = editor_row_alloc(row, len + 1);
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+}
+
+/**
+ * Add a new row to the editor buffer
+ */
+void editor_insert_row(int at, char *s, size_t len)
+{
+    // Validate index at
+    if (at < 0 || at > E.numrows)
+        return;
+
+    editor_note_change(UNDO_INSERT_ROW, at, 0, s, len, NULL, 0);
+    erow row;
+    editor_init_row(&row, s, len);
+    rows_insert(at, &row);
+    E.numrows++;
+    E.dirty++;
+}
+
+/**
+ * Free row text, or hold on to it until a background save is done with it
+ */
+void editor_free_chars(erow *row)
+{
+    if (row->flags & ROW_INLINE)
+        return;
+    // Text in blocks stays readable until the save is done anyway
+    if (!(row->flags & ROW_PINNED) || !(row->flags & ROW_BIG) || E.save == NULL)
+    {
+        text_free(row->u.ref, row->flags & ROW_BIG);
+        return;
+    }
+
+    if (E.save_ngarbage == E.save_garbagecap)
+    {
+        E.save_garbagecap = E.save_garbagecap ? E.save_garbagecap * 2 : 64;
+        E.save_garbage = xrealloc(E.save_garbage, sizeof(char *) * E.save_garbagecap);
+    }
+    E.save_garbage[E.save_ngarbage++] = text_detach_big(row->u.ref);
+}
+
+/**
+ * Move a row's text to cap bytes of new text, keeping the first keep
+ * bytes. Big text is resized in place unless a save is reading it
+ */
+void editor_row_resize(erow *row, int cap, int keep)
+{
+    if (cap > MIM_TEXT_MAX && row->flags & ROW_BIG && !(row->flags & ROW_PINNED && E.save))
+    {
+        text_realloc_big(row->u.ref, cap);
+        return;
+    }
+    // The old text is copied and freed through a copy of the row, as
+    // inline text is overwritten by the new
+    erow old = *row;
+    char *p = editor_row_alloc(row, cap);
+    memcpy(p, editor_row_chars(&old), keep);
+    editor_free_chars(&old);
+}
+
+/**
+ * Give a row its own chars before changing them in place
+ * if a background save is still writing the old ones
+ */
+void editor_row_unshare(erow *row)
+{
+    if (!(row->flags & ROW_PINNED))
+        return;
+    if (E.save && (row->flags & ROW_LONG))
+    {
+        // The copy is made with the gap closed
+        struct long_line *ll = E.lines[row->slot];
+        erow old = *row;
+        char *chars = editor_row_chars(&old);
+        char *p = editor_row_alloc(row, row->size + 1);
+        memcpy(p, chars, ll->gap);
+        memcpy(p + ll->gap, chars + ll->gap + ll->gaplen, row->size - ll->gap);
+        p[row->size] = '\0';
+        editor_free_chars(&old);
+        ll->gap = row->size;
+        ll->gaplen = 0;
+    }
+    else if (E.save)
+    {
+        editor_row_resize(row, row->size + 1, row->size + 1);
+        row->flags &= ~ROW_CAP;
+    }
+    // Pins left over from a finished save are just dropped
+    row->flags &= ~ROW_PINNED;
+}
+
+/**
+ * Free memory allocated for a row
+ */
+void editor_free_row(erow *row)
+{
+    // Any render left in the cache just ages out
+    if (row->flags & ROW_LONG)
+        editor_long_free(row);
+    if (!(row->flags & ROW_VIEW))
+        editor_free_chars(row);
+}
+
+/**
+ * Delete a row at specified position
+ */
+void editor_del_row(int at)
+{
+    // Validate row index
+    if (at < 0 || at >= E.numrows)
+        return;
+    erow *row = editor_row(at);
+    editor_row_close_gap(row);
+    editor_note_change(UNDO_DELETE_ROW, at, 0, editor_row_chars(row), row->size, NULL, 0);
+    editor_free_row(row);
+    rows_delete(at);
+    E.numrows--;
+    E.dirty++;
+}
+
+/**
+ * Add the lines of s, joined by \n, as rows from line number at on. All
+ * of them go in with one tree walk per leaf and one undo record. Rows can
+ * hold a lone \r, so only \n splits them
+ */
+void editor_insert_rows(int at, char *s, size_t len)
+{
+    if (at < 0 || at > E.numrows)
+        return;
+
+    int k = 1;
+    char *p = s, *end = s + len, *nl;
+    while (p < end && (nl = memchr(p, '\n', end - p)))
+    {
+        k++;
+        p = nl + 1;
+    }
+    editor_note_change(UNDO_INSERT_ROWS, at, k, s, len, NULL, 0);
+
+    erow *rows = xmalloc(sizeof(erow) * k);
+    p = s;
+    int n;
+    for (n = 0; n < k; n++)
+    {
+        nl = n < k - 1 ? memchr(p, '\n', end - p) : end;
+        editor_init_row(&rows[n], p, nl - p);
+        p = nl + 1;
+    }
+    rows_insert_range(at, rows, k);
+    free(rows);
+    E.numrows += k;
+    E.dirty++;
+}
+
+/**
+ * Append the text of k rows from line number at on to ab, as lines
+ * joined by \n
+ */
+void editor_rows_text(int at, int k, struct abuf *ab)
+{
+    int j;
+    for (j = 0; j < k; j++)
+    {
+        erow *row = editor_row(at + j);
+        editor_row_close_gap(row);
+        if (j > 0)
+            ab_append(ab, "\n", 1);
+        ab_append(ab, editor_row_chars(row), row->size);
+    }
+}
+
+/**
+ * Delete k rows from line number at on, as one undo record
+ */
+void editor_delete_rows(int at, int k)
+{
+    if (at < 0 || k <= 0 || at + k > E.numrows)
+        return;
+
+    struct abuf text = ABUT_INIT;
+    editor_rows_text(at, k, &text);
+    editor_note_change(UNDO_DELETE_ROWS, at, k, text.b, text.len, NULL, 0);
+    ab_free(&text);
+
+    int j;
+    for (j = 0; j < k; j++)
+        editor_free_row(editor_row(at + j));
+    rows_delete_range(at, k);
+    E.numrows -= k;
+    E.dirty++;
+}
+
+/**
+ * Replace the whole text of a row
+ */
+void editor_row_set(int y, char *s, size_t len)
+{
+    erow *row = editor_row(y);
+    editor_row_close_gap(row);
+    editor_note_change(UNDO_SET_ROW, y, 0, editor_row_chars(row), row->size, s, len);
+    if (row->flags & ROW_LONG)
+        editor_long_free(row);
+    editor_free_chars(row);
+    char *chars = editor_row_alloc(row, len + 1);
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+    row->size = len;
+    editor_update_row(row);
+    E.dirty++;
+}
+
+/**
+ * Room for a row's chars, rounded up so edits only now and then realloc
+ */
+int editor_row_cap(int size)
+{
+    int cap = 16;
+    while (cap < size + 1)
+        cap *= 2;
+    return cap;
+}
+
+/**
+ * Make room in a row's chars for size chars plus the '\0'
+ */
+void editor_row_reserve(erow *row, int size)
+{
+    if (row->flags & ROW_INLINE ? size + 1 <= MIM_ROW_INLINE : (row->flags & ROW_CAP) && size + 1 <= editor_row_cap(row->size))
+        return;
+    editor_row_resize(row, editor_row_cap(size), row->size + 1);
+    row->flags |= ROW_CAP;
+}
+
+/**
+ * Replace dellen chars of a short row at at with len chars of s,
+ * patching the render instead of redoing it
+ */
+void editor_row_splice(erow *row, int at, int dellen, const char *s, int len)
+{
+    struct render_entry *cached = editor_render_cached(row);
+    int rx = 0, oldend = 0;
+    if (cached)
+    {
+        rx = editor_row_cx_to_rx(row, at);
+        oldend = rx + editor_render_width(&editor_row_chars(row)[at], dellen, rx);
+    }
+
+    if (len > dellen)
+        editor_row_reserve(row, row->size + len - dellen);
+    // Shift from [at+dellen] to [at+len], incl. '\0'
+    char *chars = editor_row_chars(row);
+    memmove(&chars[at + len], &chars[at + dellen], row->size - at - dellen + 1);
+    if (len)
+        memcpy(&chars[at], s, len);
+    row->size += len - dellen;
+
+    if (cached)
+        editor_render_patch(row, at, len, rx, oldend);
+    // Tab-free rows stay tab-free unless a tab went in
+    else if (!(row->flags & ROW_PLAIN) || (len && memchr(s, '\t', len)))
+        editor_update_row(row);
+}
+
+/**
+ * Insert a character into a row at specified position
+ */
+void editor_row_insert_char(int y, int at, int c)
+{
+    erow *row = editor_row(y);
+    // Validate at index
+    if (at < 0 || at > row->size)
+        at = row->size;
+    char ch = c;
+    editor_note_change(UNDO_INSERT, y, at, &ch, 1, NULL, 0);
+    editor_row_unshare(row);
+    if (editor_row_long(row, row->size))
+        editor_long_insert(row, at, &ch, 1);
+    else
+        editor_row_splice(row, at, 0, &ch, 1);
+    E.dirty++;
+}
+
+/**
+ * Insert a string into a row at specified position
+ */
+void editor_row_insert_string(int y, int at, char *s, size_t len)
+{
+    erow *row = editor_row(y);
+    if (at < 0 || at > row->size)
+        at = row->size;
+    editor_note_change(UNDO_INSERT, y, at, s, len, NULL, 0);
+    editor_row_unshare(row);
+    if (editor_row_long(row, row->size + len))
+        editor_long_insert(row, at, s, len);
+    else
+        editor_row_splice(row, at, 0, s, len);
+    E.dirty++;
+}
+
+/**
+ * Append a string to end of specified row
+ */
+void editor_row_append_string(int y, char *s, size_t len)
+{
+    erow *row = editor_row(y);
+    editor_note_change(UNDO_INSERT, y, row->size, s, len, NULL, 0);
+    editor_row_unshare(row);
+    if (editor_row_long(row, row->size + len))
+        editor_long_insert(row, row->size, s, len);
+    else
+        editor_row_splice(row, row->size, 0, s, len);
+    E.dirty++;
+}
+
+/**
+ * Delete len characters from a row at specified position
+ */
+void editor_row_delete(int y, int at, int len)
+{
+    erow *row = editor_row(y);
+    if (at < 0 || at >= row->size || len <= 0)
+        return;
+    if (len > row->size - at)
+        len = row->size - at;
+    if (editor_row_long(row, row->size))
+    {
+        // The deleted text follows the gap once it is moved there
+        editor_row_unshare(row);
+        struct long_line *ll = editor_long_line(row);
+        editor_long_move_gap(row, ll, at);
+        editor_note_change(UNDO_DELETE, y, at, editor_row_chars(row) + at + ll->gaplen, len, NULL, 0);
+        editor_long_delete(row, ll, at, len);
+        E.dirty++;
+        return;
+    }
+    editor_note_change(UNDO_DELETE, y, at, &editor_row_chars(row)[at], len, NULL, 0);
+    editor_row_unshare(row);
+    editor_row_splice(row, at, len, NULL, 0);
+    E.dirty++;
+}
+
+/**
+ * Cut a row short at specified position
+ */
+void editor_row_truncate(int y, int at)
+{
+    editor_row_delete(y, at, editor_row(y)->size - at);
+}
+
+/**
+ * Delete character at specified position in row
+ */
+void editor_row_del_char(int y, int at)
+{
+    editor_row_delete(y, at, 1);
+}
+
+/*** EDITOR OPERATIONS ***/
+
+/**
+ * Refuse to edit a read-only buffer, telling the user why
+ */
+bool editor_check_readonly()
+{
+    if (!E.readonly)
+        return false;
+    editor_set_status_message("Read-only view, reopen without -R to edit");
+    return true;
+}
+
+/**
+ * Insert a character at current cursor position
+ */
+void editor_insert_char(int c)
+{
+    if (editor_check_readonly())
+        return;
+    if (E.cy == E.numrows)
+    {
+        // Append a new row
+        editor_insert_row(E.numrows, " ", 0);
+    }
+    editor_row_insert_char(E.cy, E.cx, c);
+    E.cx++;
+}
+
+/**
+ * Insert a newline at current cursor position
+ */
+void editor_insert_newline()
+{
+    if (editor_check_readonly())
+        return;
+    if (E.cx == 0)
+    {
+        editor_insert_row(E.cy, "", 0);
+    }
+    else
+    {
+        erow *row = editor_row(E.cy);
+        editor_row_close_gap(row);
+        // Insert a row below with the rest of the line contents
+        editor_insert_row(E.cy + 1, &editor_row_chars(row)[E.cx], row->size - E.cx);
+        editor_row_truncate(E.cy, E.cx);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+/**
+ * Delete character at current cursor position
+ */
+void editor_del_char()
+{
+    if (editor_check_readonly())
+        return;
+    // Cursor past file, return
+    if (E.cy == E.numrows)
+        return;
+    // Cursor top of file, return
+    if (E.cx == 0 && E.cy == 0)
+        return;
+
+    erow *row = editor_row(E.cy);
+    // Character to the left, then delete
+    if (E.cx > 0)
+    {
+        editor_row_del_char(E.cy, E.cx - 1);
+        E.cx--;
+    }
+    // If deleteing from first position, merge rows
+    else
+    {
+        int prevsize = editor_row(E.cy - 1)->size;
+        editor_row_close_gap(row);
+        editor_row_append_string(E.cy - 1, editor_row_chars(row), row->size);
+        editor_del_row(E.cy);
+        E.cy--;
+        E.cx = prevsize;
+    }
+}
+/**
+ * Length of the line break at s[0], 0 if there is none
+ */
+size_t editor_newline_len(char *s, size_t len)
+{
+    if (len == 0 || (s[0] != '\r' && s[0] != '\n'))
+        return 0;
+    // Terminals paste line breaks as \r, files may use \r\n
+    return (s[0] == '\r' && len > 1 && s[1] == '\n') ? 2 : 1;
+}
+
+/**
+ * Insert a block of text at the cursor, splitting it into rows on line breaks
+ */
+void editor_insert_text(char *s, size_t len)
+{
+    if (editor_check_readonly() || len == 0)
+        return;
+    if (E.cy == E.numrows)
+        editor_insert_row(E.numrows, "", 0);
+
+    size_t end = 0;
+    while (end < len && !editor_newline_len(&s[end], len - end))
+        end++;
+    if (end == len)
+    {
+        // Single line, one memmove into the cursor row
+        editor_row_insert_string(E.cy, E.cx, s, len);
+        E.cx += len;
+        return;
+    }
+
+    // Split the cursor row, its tail goes after the last inserted line
+    erow *row = editor_row(E.cy);
+    editor_row_close_gap(row);
+    size_t taillen = row->size - E.cx;
+    char *tail = xmalloc(taillen + 1);
+    memcpy(tail, &editor_row_chars(row)[E.cx], taillen);
+    editor_row_truncate(E.cy, E.cx);
+    editor_row_append_string(E.cy, s, end);
+
+    // The other lines go in as a block of rows, their breaks made \n
+    size_t start = end + editor_newline_len(&s[end], len - end);
+    char *lines = xmalloc(len - start + 1);
+    size_t n = 0;
+    for (end = start; end < len;)
+    {
+        size_t nl = editor_newline_len(&s[end], len - end);
+        lines[n++] = nl ? '\n' : s[end];
+        end += nl ? nl : 1;
+    }
+    int before = E.numrows;
+    editor_insert_rows(E.cy + 1, lines, n);
+
+    // Cursor lands after the inserted text, before the old tail
+    char *last = memrchr(lines, '\n', n);
+    E.cy += E.numrows - before;
+    E.cx = last ? lines + n - last - 1 : (int)n;
+    free(lines);
+    editor_row_append_string(E.cy, tail, taillen);
+    free(tail);
+}
+
+/**
+ * Set or clear the mark that cut and copy take a block of lines from
+ */
+void editor_toggle_mark()
+{
+    if (E.kill.mark != -1)
+    {
+        E.kill.mark = -1;
+        editor_set_status_message("Mark cleared");
+        return;
+    }
+    E.kill.mark = E.cy < E.numrows ? E.cy : E.numrows - 1;
+    if (E.kill.mark < 0)
+        E.kill.mark = 0;
+    editor_set_status_message("Mark set, CTRL+K cuts or CTRL+C copies the lines up to the cursor");
+}
+
+/**
+ * Cut (or copy) the current line, or the lines from the mark to the
+ * cursor, into the kill ring. Lines cut one after another go into a
+ * single entry
+ */
+void editor_kill(bool cut)
+{
+    if (editor_check_readonly() || E.numrows == 0)
+        return;
+    int from = E.cy < E.numrows ? E.cy : E.numrows - 1;
+    int to = from;
+    if (E.kill.mark != -1)
+    {
+        from = E.kill.mark < from ? E.kill.mark : from;
+        to = E.kill.mark > to ? E.kill.mark : to;
+        if (to >= E.numrows)
+            to = E.numrows - 1;
+        E.kill.mark = -1;
+    }
+    int k = to - from + 1;
+
+    struct kill_ring *kr = &E.kill;
+    int newest = (kr->head + MIM_KILL_RING - 1) % MIM_KILL_RING;
+    struct abuf text = ABUT_INIT;
+    if (cut && kr->prev_key == CTRL_KEY('k') && kr->n > 0)
+    {
+        // Add on to the lines cut just before
+        text.b = kr->text[newest];
+        text.len = text.cap = kr->len[newest];
+        ab_append(&text, "\n", 1);
+    }
+    else
+    {
+        // Oldest entry makes way
+        free(kr->text[kr->head]);
+        newest = kr->head;
+        kr->head = (kr->head + 1) % MIM_KILL_RING;
+        if (kr->n < MIM_KILL_RING)
+            kr->n++;
+    }
+    editor_rows_text(from, k, &text);
+    kr->text[newest] = text.b;
+    kr->len[newest] = text.len;
+
+    if (cut)
+    {
+        editor_delete_rows(from, k);
+        E.cy = from;
+        E.cx = 0;
+        editor_set_status_message("Cut %d line%s", k, k == 1 ? "" : "s");
+    }
+    else
+    {
+        editor_set_status_message("Copied %d line%s", k, k == 1 ? "" : "s");
+    }
+}
+
+/**
+ * Paste a kill ring entry, back from the newest, above the cursor line
+ * and move the cursor below it
+ */
+void editor_yank(int back)
+{
+    struct kill_ring *kr = &E.kill;
+    kr->yanked = false;
+    if (editor_check_readonly())
+        return;
+    if (kr->n == 0)
+    {
+        editor_set_status_message("Nothing to paste, CTRL+K cuts and CTRL+C copies lines");
+        return;
+    }
+
+    int entry = (kr->head + MIM_KILL_RING - 1 - back % kr->n) % MIM_KILL_RING;
+    int at = E.cy < E.numrows ? E.cy : E.numrows;
+    int before = E.numrows;
+    // A single empty line copies as no text at all
+    editor_insert_rows(at, kr->text[entry] ? kr->text[entry] : "", kr->len[entry]);
+    kr->yank = back % kr->n;
+    kr->yank_at = at;
+    kr->yank_rows = E.numrows - before;
+    E.cy = at + kr->yank_rows;
+    E.cx = 0;
+    kr->yanked = true;
+}
+
+/**
+ * Swap the lines just pasted for the entry before them in the kill ring
+ */
+void editor_yank_pop()
+{
+    struct kill_ring *kr = &E.kill;
+    if (!kr->yanked)
+    {
+        editor_set_status_message("CTRL+P right after a paste swaps in older cut lines");
+        return;
+    }
+    kr->yanked = false;
+    if (editor_check_readonly())
+        return;
+    // Kept inside the buffer whatever happened to it since
+    if (kr->yank_at > E.numrows)
+        kr->yank_at = E.numrows;
+    if (kr->yank_rows > E.numrows - kr->yank_at)
+        kr->yank_rows = E.numrows - kr->yank_at;
+    editor_delete_rows(kr->yank_at, kr->yank_rows);
+    E.cy = kr->yank_at;
+    editor_yank(kr->yank + 1);
+    editor_set_status_message("Pasted entry %d of %d", kr->yank + 1, kr->n);
+}
+
+/**
+ * Take back the last undo step
+ */
+void editor_undo()
+{
+    struct undo_log *u = &E.undo;
+    if (editor_check_readonly())
+        return;
+    if (u->pos == u->first)
+    {
+        editor_set_status_message("Nothing to undo");
+        return;
+    }
+
+    u->applying = true;
+    struct undo_rec *rec;
+    do
+    {
+        rec = &u->recs[--u->pos];
+        char *text = &u->text[rec->off];
+        switch (rec->type)
+        {
+        case UNDO_INSERT:
+            editor_row_delete(rec->y, rec->x, rec->len);
+            break;
+        case UNDO_DELETE:
+            editor_row_insert_string(rec->y, rec->x, text, rec->len);
+            break;
+        case UNDO_INSERT_ROW:
+            editor_del_row(rec->y);
+            break;
+        case UNDO_DELETE_ROW:
+            editor_insert_row(rec->y, text, rec->len);
+            break;
+        case UNDO_SET_ROW:
+            editor_row_set(rec->y, text, rec->len);
+            break;
+        case UNDO_INSERT_ROWS:
+            editor_delete_rows(rec->y, rec->x);
+            break;
+        case UNDO_DELETE_ROWS:
+            editor_insert_rows(rec->y, text, rec->len);
+            break;
+        }
+    } while (!rec->start && u->pos > u->first);
+    u->applying = false;
+
+    E.cy = rec->cy;
+    E.cx = rec->cx;
+}
+
+/**
+ * Make a recorded change again, for redo and journal replay
+ */
+void editor_apply_change(int type, int y, int x, char *s, int len, char *s2, int len2)
+{
+    switch (type)
+    {
+    case UNDO_INSERT:
+        editor_row_insert_string(y, x, s, len);
+        break;
+    case UNDO_DELETE:
+        editor_row_delete(y, x, len);
+        break;
+    case UNDO_INSERT_ROW:
+        editor_insert_row(y, s, len);
+        break;
+    case UNDO_DELETE_ROW:
+        editor_del_row(y);
+        break;
+    case UNDO_SET_ROW:
+        editor_row_set(y, s2, len2);
+        break;
+    case UNDO_INSERT_ROWS:
+        editor_insert_rows(y, s, len);
+        break;
+    case UNDO_DELETE_ROWS:
+        editor_delete_rows(y, x);
+        break;
+    }
+}
+
+/**
+ * Make the last undone step again
+ */
+void editor_redo()
+{
+    struct undo_log *u = &E.undo;
+    if (editor_check_readonly())
+        return;
+    if (u->pos == u->n)
+    {
+        editor_set_status_message("Nothing to redo");
+        return;
+    }
+
+    u->applying = true;
+    struct undo_rec *rec;
+    do
+    {
+        rec = &u->recs[u->pos++];
+        char *text = &u->text[rec->off];
+        editor_apply_change(rec->type, rec->y, rec->x, text, rec->len, text + rec->len, rec->len2);
+    } while (u->pos < u->n && !u->recs[u->pos].start);
+    u->applying = false;
+
+    E.cy = rec->acy;
+    E.cx = rec->acx;
+}
+
+/*** FILE IO ***/
+
+/**
+ * Turn a run of lines read from disk into rows appended to the buffer
+ */
+void editor_load_rows(char *text, size_t len)
+{
+    erow rows[ROWS_LEAF_MAX];
+    int n = 0;
+    char *p = text;
+    char *end = text + len;
+    while (p < end)
+    {
+        // memchr scans a word or vector at a time, much faster than per byte
+        char *nl = memchr(p, '\n', end - p);
+        size_t linelen = (nl ? nl : end) - p;
+        // Trim carriage returns left before the newline
+        while (linelen > 0 && p[linelen - 1] == '\r')
+            linelen--;
+
+        // Rows go in a leaf at a time
+        editor_init_row(&rows[n++], p, linelen);
+        if (n == ROWS_LEAF_MAX)
+        {
+            rows_append(rows, n);
+            n = 0;
+        }
+        p = nl ? nl + 1 : end;
+    }
+    rows_append(rows, n);
+}
+
+/**
+ * Queue lines for the main thread, waiting while it is MIM_LOAD_QUEUE
+ * bytes behind
+ */
+void editor_load_push(struct load_job *job, char *text, size_t len)
+{
+    struct load_batch *batch = xmalloc(sizeof(struct load_batch));
+    batch->text = text;
+    batch->len = len;
+    batch->next = NULL;
+
+    pthread_mutex_lock(&job->lock);
+    while (job->queued >= MIM_LOAD_QUEUE)
+        pthread_cond_wait(&job->cond, &job->lock);
+    if (job->tail)
+        job->tail->next = batch;
+    else
+        job->head = batch;
+    job->tail = batch;
+    job->queued += len;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    editor_wake();
+}
+
+/**
+ * Loader thread, reads the file in blocks and hands over the whole
+ * lines in each, carrying a partial last line over to the next
+ */
+void *editor_load_thread(void *arg)
+{
+    struct load_job *job = arg;
+    size_t cap = MIM_LOAD_BLOCK;
+    char *buf = xmalloc(cap);
+    size_t len = 0;
+    int err = 0;
+
+    while (true)
+    {
+        ssize_t nread = read(job->fd, buf + len, cap - len);
+        if (nread == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            err = errno;
+            break;
+        }
+        if (nread == 0)
+            break;
+        len += nread;
+
+        char *nl = memrchr(buf, '\n', len);
+        if (nl == NULL)
+        {
+            // Line is longer than the whole block, make room for the rest
+            if (len == cap)
+            {
+                cap *= 2;
+                buf = xrealloc(buf, cap);
+            }
+            continue;
+        }
+
+        size_t keep = buf + len - (nl + 1);
+        cap = MIM_LOAD_BLOCK;
+        while (cap <= keep)
+            cap *= 2;
+        char *next = xmalloc(cap);
+        memcpy(next, nl + 1, keep);
+        editor_load_push(job, buf, len - keep);
+        buf = next;
+        len = keep;
+    }
+
+    // Last line without a trailing newline
+    if (len > 0)
+        editor_load_push(job, buf, len);
+    else
+        free(buf);
+
+    pthread_mutex_lock(&job->lock);
+    job->done = true;
+    job->err = err;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    editor_wake();
+    return NULL;
+}
+
+/**
+ * Start reading fd into the buffer on the loader thread
+ */
+void editor_load_start(int fd)
+{
+    struct load_job *job = xmalloc(sizeof(struct load_job));
+    memset(job, 0, sizeof(struct load_job));
+    job->fd = fd;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        job->size = st.st_size;
+    else
+        job->stream = true;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    if (pthread_create(&job->thread, NULL, editor_load_thread, job) != 0)
+        die("pthread_create");
+    E.load = job;
+}
+
+/**
+ * Check whether the loader has anything for editor_load_step
+ */
+bool editor_load_ready()
+{
+    struct load_job *job = E.load;
+    if (job == NULL)
+        return false;
+    pthread_mutex_lock(&job->lock);
+    bool ready = job->head != NULL || job->done;
+    pthread_mutex_unlock(&job->lock);
+    return ready;
+}
+
+/**
+ * Append the lines the loader has read to the buffer, for up to
+ * MIM_LOAD_BUDGET ms or, with wait set, until the whole file is in.
+ * Returns true if any rows were added
+ */
+bool editor_load_step(bool wait)
+{
+    struct load_job *job = E.load;
+    if (job == NULL)
+        return false;
+
+    double start = editor_prof_now();
+    bool added = false;
+    while (true)
+    {
+        pthread_mutex_lock(&job->lock);
+        while (wait && job->head == NULL && !job->done)
+            pthread_cond_wait(&job->cond, &job->lock);
+        struct load_batch *batch = job->head;
+        if (batch)
+        {
+            job->head = batch->next;
+            if (job->head == NULL)
+                job->tail = NULL;
+            job->queued -= batch->len;
+            // The loader may be waiting for room
+            pthread_cond_broadcast(&job->cond);
+        }
+        bool done = job->done;
+        pthread_mutex_unlock(&job->lock);
+
+        if (batch == NULL)
+        {
+            if (!done)
+                return added;
+            // Everything is in, the loader is finished
+            pthread_join(job->thread, NULL);
+            close(job->fd);
+            if (job->err)
+                editor_set_status_message("Read error: %s", strerror(job->err));
+            pthread_mutex_destroy(&job->lock);
+            pthread_cond_destroy(&job->cond);
+            free(job);
+            E.load = NULL;
+            return true;
+        }
+
+        int before = E.numrows;
+        editor_load_rows(batch->text, batch->len);
+        job->loaded += batch->len;
+        free(batch->text);
+        free(batch);
+        added = true;
+        if (wait)
+            continue;
+        // Stop early once rows fill the screen, so they are drawn right away
+        int bottom = E.rowoff + E.screenrows;
+        if (editor_prof_now() - start >= MIM_LOAD_BUDGET || (before < bottom && E.numrows >= bottom))
+            return true;
+    }
+}
+
+/**
+ * Wait for the rest of the file before something that needs all of it.
+ * A stream may never end, what came in so far has to do
+ */
+void editor_load_finish()
+{
+    if (E.load == NULL || E.load->stream)
+        return;
+    editor_set_status_message("Loading the rest of the file...");
+    editor_refresh_screen();
+    editor_load_step(true);
+}
+
+/**
+ * Map a file read-only and index where its lines start
+ */
+bool editor_map_file(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return false;
+    if (st.st_size == 0)
+        return true;
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    E.map = map;
+    E.maplen = st.st_size;
+
+    // Count lines, remembering where every MIM_VIEW_STRIDE-th one starts
+    size_t indexcap = 1024;
+    E.view_index = xmalloc(sizeof(size_t) * indexcap);
+    madvise(map, E.maplen, MADV_SEQUENTIAL);
+    char *p = map;
+    char *end = map + E.maplen;
+    while (p < end)
+    {
+        if (E.numrows % MIM_VIEW_STRIDE == 0)
+        {
+            if ((size_t)E.numrows / MIM_VIEW_STRIDE == indexcap)
+            {
+                indexcap *= 2;
+                E.view_index = xrealloc(E.view_index, sizeof(size_t) * indexcap);
+            }
+            E.view_index[E.numrows / MIM_VIEW_STRIDE] = p - map;
+        }
+        E.numrows++;
+
+        char *nl = memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+    E.view_last = -1;
+
+    // Drop the pages touched by the scan, only drawn rows get faulted back in
+    madvise(map, E.maplen, MADV_DONTNEED);
+    madvise(map, E.maplen, MADV_RANDOM);
+    return true;
+}
+
+/**
+ * Read the text of an open file or stream into the editor buffer
+ */
+void editor_open_fd(int fd)
+{
+    if (E.readonly && editor_map_file(fd))
+    {
+        close(fd);
+        E.dirty = 0;
+        return;
+    }
+
+    // Rows stream in from the loader thread while the editor runs,
+    // see editor_load_finish for waiting until all of them are in
+    editor_load_start(fd);
+    E.dirty = 0;
+}
+
+/**
+ * Open and read a file into the editor buffer
+ */
+void editor_open(char *filename)
+{
+    free(E.filename);
+    // Duplicate string instead of taking the reference
+    E.filename = xstrdup(filename);
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        // File doesn't exist, just set the filename without creating the file
+        // The file will be created when the user saves
+        // This message is actually overwritten by the help message
+        editor_set_status_message("New file: %s", filename);
+        return;
+    }
+    editor_open_fd(fd);
+}
+
+/**
+ * Write all of iov to fd, retrying after partial writes
+ */
+int editor_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // Skip the buffers that went out, then trim the one cut short
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Queue len bytes at p to be written, writing the queue once it is full
+ */
+int editor_save_queue(struct save_out *out, char *p, int len)
+{
+    out->iov[out->n].iov_base = p;
+    out->iov[out->n].iov_len = len;
+    out->total += len;
+    if (++out->n < MIM_SAVE_IOV)
+        return 0;
+    out->n = 0;
+    return editor_writev_all(out->fd, out->iov, MIM_SAVE_IOV);
+}
+
+/**
+ * Queue the rows below a node of a save job's tree, returns -1 on error
+ */
+int editor_write_node(struct save_job *job, rows_node *node, struct save_out *out)
+{
+    int j;
+    if (node->height)
+    {
+        for (j = 0; j < node->n; j++)
+        {
+            if (editor_write_node(job, node->u.in.child[j], out) == -1)
+                return -1;
+        }
+        return 0;
+    }
+
+    for (j = 0; j < node->n; j++)
+    {
+        erow *row = &node->u.rows[j];
+        char *chars = row->flags & ROW_INLINE ? row->u.text : text_ptr_in(job->table, job->big, row->u.ref, row->flags & ROW_BIG);
+        int gap = row->size;
+        int gaplen = 0;
+        if (row->flags & ROW_LONG)
+        {
+            gap = job->gaps[row->slot].gap;
+            gaplen = job->gaps[row->slot].gaplen;
+        }
+
+        // Rows go out straight from their own memory, never copied
+        if (gap > 0 && editor_save_queue(out, chars, gap) == -1)
+            return -1;
+        if (gap < row->size && editor_save_queue(out, chars + gap + gaplen, row->size - gap) == -1)
+            return -1;
+        if (editor_save_queue(out, "\n", 1) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stream the rows of a save job to fd, returns the number of bytes written or -1
+ */
+long long editor_write_rows(int fd, struct save_job *job)
+{
+    struct save_out out;
+    out.fd = fd;
+    out.n = 0;
+    out.total = 0;
+    if (editor_write_node(job, job->root, &out) == -1)
+        return -1;
+    if (out.n > 0 && editor_writev_all(fd, out.iov, out.n) == -1)
+        return -1;
+    return out.total;
+}
+
+/**
+ * Write a save job to a temporary file next to its file, sync it and
+ * rename it over the file, so a crash leaves either the old or the new one.
+ * Returns the number of bytes written or -1 with errno set
+ */
+long long editor_save_file(struct save_job *job)
+{
+    // Replace the file a symlink points to, not the link
+    char *target = realpath(job->filename, NULL);
+    if (target == NULL)
+        target = xstrdup(job->filename);
+
+    // Keep the permissions of the file being replaced
+    struct stat st;
+    mode_t mode = 0644;
+    if (stat(target, &st) == 0)
+        mode = st.st_mode & 07777;
+
+    size_t tmplen = strlen(target) + 8;
+    char *tmp = xmalloc(tmplen);
+    snprintf(tmp, tmplen, "%s.XXXXXX", target);
+
+    long long len = -1;
+    int fd = mkstemp(tmp);
+    if (fd != -1)
+    {
+        if (fchmod(fd, mode) != -1 && (len = editor_write_rows(fd, job)) != -1 && fsync(fd) == -1)
+            len = -1;
+        if (close(fd) == -1)
+            len = -1;
+        if (len != -1 && rename(tmp, target) == -1)
+            len = -1;
+
+        if (len == -1)
+        {
+            int saved = errno;
+            unlink(tmp);
+            errno = saved;
+        }
+        else
+        {
+            // Make the rename itself durable
+            char *dir = dirname(tmp);
+            int dirfd = open(dir, O_RDONLY);
+            if (dirfd != -1)
+            {
+                fsync(dirfd);
+                close(dirfd);
+            }
+        }
+    }
+    free(tmp);
+    free(target);
+    return len;
+}
+
+/**
+ * Writer thread, runs one save job and wakes the event loop when done
+ */
+void *editor_save_worker(void *arg)
+{
+    struct save_job *job = arg;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long long len = editor_save_file(job);
+    int err = errno;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&job->lock);
+    job->len = len;
+    job->err = err;
+    job->ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    job->done = true;
+    pthread_mutex_unlock(&job->lock);
+
+    editor_wake();
+    return NULL;
+}
+
+/**
+ * Collect a finished background save, or wait for it when wait is set.
+ * Returns true if a save was collected
+ */
+bool editor_finish_save(bool wait)
+{
+    struct save_job *job = E.save;
+    if (job == NULL)
+        return false;
+
+    pthread_mutex_lock(&job->lock);
+    bool done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    if (!done && !wait)
+        return false;
+    if (job->threaded)
+        pthread_join(E.save_thread, NULL);
+
+    if (job->len == -1)
+    {
+        editor_set_status_message("Failed to save! I/O error: %s", strerror(job->err));
+    }
+    else
+    {
+        // Edits made while the writer ran still count as unsaved
+        E.dirty -= E.save_dirty;
+        editor_journal_saved();
+        if (E.save_new_file)
+        {
+            editor_set_status_message("New file created: %s. %lld bytes written in %.0f ms", job->filename, job->len, job->ms);
+        }
+        else
+        {
+            editor_set_status_message("%lld bytes written to disk in %.0f ms", job->len, job->ms);
+        }
+    }
+
+    // Text replaced or deleted during the save can go now
+    int j;
+    for (j = 0; j < E.save_ngarbage; j++)
+        free(E.save_garbage[j]);
+    E.save_ngarbage = 0;
+    text_sweep();
+
+    // Nodes only the save still held go
+    rows_node_free(job->root);
+    free(job->table);
+    free(job->big);
+    free(job->gaps);
+    pthread_mutex_destroy(&job->lock);
+    free(job->filename);
+    free(job);
+    E.save = NULL;
+    return true;
+}
+
+/**
+ * Save current file to disk
+ */
+void editor_save()
+{
+    if (editor_check_readonly())
+        return;
+    if (E.save)
+    {
+        editor_set_status_message("Save already in progress");
+        return;
+    }
+    // Only the whole file can be written back
+    editor_load_finish();
+    if (E.filename == NULL)
+    {
+        E.filename = editor_prompt("Save as: %s", NULL, false);
+        if (E.filename == NULL)
+        {
+            editor_set_status_message("Save aborted");
+            return;
+        }
+    }
+
+    // Check if file already exists to differentiate messages
+    E.save_new_file = access(E.filename, F_OK) != 0;
+
+    // Snapshot the rows by sharing the tree with the writer. Edits copy
+    // the nodes on their way down and pin the text of copied leaves, see
+    // rows_own, so nothing the writer reads changes under it. Only the
+    // tables saying where text is are copied
+    struct save_job *job = xmalloc(sizeof(struct save_job));
+    job->filename = xstrdup(E.filename);
+    job->root = E.rows;
+    E.rows->refs++;
+    // The hint is the one node looked up without walking down to it
+    E.rows_hint = NULL;
+    job->table = xmalloc(sizeof(struct text_block *) * (E.text.ntable ? E.text.ntable : 1));
+    if (E.text.ntable)
+        memcpy(job->table, E.text.table, sizeof(struct text_block *) * E.text.ntable);
+    job->big = xmalloc(sizeof(char *) * (E.text.nbig ? E.text.nbig : 1));
+    if (E.text.nbig)
+        memcpy(job->big, E.text.big, sizeof(char *) * E.text.nbig);
+    job->gaps = xmalloc(sizeof(struct save_gap) * (E.nlines ? E.nlines : 1));
+    int j;
+    for (j = 0; j < E.nlines; j++)
+    {
+        if (E.lines[j] == NULL)
+            continue;
+        job->gaps[j].gap = E.lines[j]->gap;
+        job->gaps[j].gaplen = E.lines[j]->gaplen;
+    }
+    job->done = false;
+    pthread_mutex_init(&job->lock, NULL);
+    E.save = job;
+    E.save_dirty = E.dirty;
+    E.journal.save_mark = E.journal.len;
+
+    job->threaded = pthread_create(&E.save_thread, NULL, editor_save_worker, job) == 0;
+    if (!job->threaded)
+    {
+        // No thread, save in the foreground instead
+        editor_save_worker(job);
+        editor_finish_save(true);
+        return;
+    }
+    editor_set_status_message("Saving %s...", E.filename);
+}
+
+/**
+ * Make room for len more bytes, growing geometrically
+ */
+bool ab_reserve(struct abuf *ab, int len)
+{
+    if (ab->len + len <= ab->cap)
+        return true;
+
+    // Double so a buffer reused every frame stops reallocating quickly
+    int cap = ab->cap ? ab->cap * 2 : 256;
+    while (cap < ab->len + len)
+        cap *= 2;
+    char *new = xrealloc(ab->b, cap);
+
+    if (new == NULL)
+        return false;
+    ab->b = new;
+    ab->cap = cap;
+    return true;
+}
+
+/**
+ * Append string to append buffer
+ */
+void ab_append(struct abuf *ab, const char *s, int len)
+{
+    if (len <= 0 || !ab_reserve(ab, len))
+        return;
+    // Append and update buf
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
+}
+
+/**
+ * Append n copies of c to append buffer
+ */
+void ab_fill(struct abuf *ab, char c, int n)
+{
+    if (n <= 0 || !ab_reserve(ab, n))
+        return;
+    memset(&ab->b[ab->len], c, n);
+    ab->len += n;
+}
+
+/**
+ * Free memory used by append buffer
+ */
+void ab_free(struct abuf *ab)
+{
+    free(ab->b);
+}
+
+/*** JOURNAL ***/
+
+/**
+ * Path of the recovery journal kept next to a file
+ */
+char *editor_journal_path(const char *filename)
+{
+    // Journal the real file, like saving does
+    char *real = realpath(filename, NULL);
+    char *d = xstrdup(real ? real : filename);
+    char *b = xstrdup(real ? real : filename);
+    char *dir = dirname(d);
+    char *base = basename(b);
+
+    size_t len = strlen(dir) + strlen(base) + 16;
+    char *path = xmalloc(len);
+    snprintf(path, len, "%s/.%s.mim-journal", dir, base);
+    free(real);
+    free(d);
+    free(b);
+    return path;
+}
+
+/**
+ * Fill in the header tying a journal to the file version it applies to
+ */
+void editor_journal_header(char *header, const char *filename)
+{
+    long long meta[3] = {-1, 0, 0};
+    struct stat st;
+    if (stat(filename, &st) == 0)
+    {
+        meta[0] = st.st_size;
+        meta[1] = st.st_mtim.tv_sec;
+        meta[2] = st.st_mtim.tv_nsec;
+    }
+    memcpy(header, MIM_JOURNAL_MAGIC, 8);
+    memcpy(header + 8, meta, sizeof(meta));
+}
+
+/**
+ * Write all of a buffer to the journal and sync it
+ */
+int editor_journal_write(int fd, char *buf, int len)
+{
+    struct iovec iov = {buf, len};
+    if (len > 0 && editor_writev_all(fd, &iov, 1) == -1)
+        return -1;
+    return fdatasync(fd);
+}
+
+/**
+ * Start the journal over with only the records from mark on, the ones
+ * a save didn't cover. Runs on the flusher, once they are all written
+ */
+int editor_journal_rotate(struct journal *jn, long long mark)
+{
+    size_t tmplen = strlen(jn->path) + 8;
+    char *tmp = xmalloc(tmplen);
+    snprintf(tmp, tmplen, "%s.new", jn->path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    char header[MIM_JOURNAL_HEADER];
+    editor_journal_header(header, jn->filename);
+    bool ok = fd != -1 && write(fd, header, sizeof(header)) == sizeof(header);
+
+    off_t off = MIM_JOURNAL_HEADER + mark - jn->base;
+    off_t end = MIM_JOURNAL_HEADER + jn->written - jn->base;
+    char buf[65536];
+    while (ok && off < end)
+    {
+        ssize_t n = pread(jn->fd, buf, end - off < (off_t)sizeof(buf) ? end - off : (off_t)sizeof(buf), off);
+        if (n <= 0 || write(fd, buf, n) != n)
+            ok = false;
+        off += n;
+    }
+
+    // The new journal takes over the old one's descriptor, so fd never
+    // changes under the editor
+    if (ok && fdatasync(fd) == 0 && rename(tmp, jn->path) == 0 && dup2(fd, jn->fd) != -1)
+    {
+        close(fd);
+        jn->base = mark;
+        free(tmp);
+        return 0;
+    }
+    int err = errno;
+    if (fd != -1)
+        close(fd);
+    unlink(tmp);
+    free(tmp);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Flusher thread, writes out batches of records so typing never waits
+ * for the disk
+ */
+void *editor_journal_worker(void *arg)
+{
+    struct journal *jn = arg;
+    pthread_mutex_lock(&jn->lock);
+    while (true)
+    {
+        while (jn->buf.len == 0 && jn->rotate == -1 && !jn->stop)
+            pthread_cond_wait(&jn->cond, &jn->lock);
+        if (jn->buf.len == 0 && jn->rotate == -1)
+            break;
+
+        // Let a burst of edits pile up, one sync covers them all. After
+        // a save the journal is started over right away
+        if (!jn->stop && jn->rotate == -1)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += MIM_JOURNAL_INTERVAL * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&jn->cond, &jn->lock, &ts);
+        }
+
+        // Write the batch unlocked, new records go to the other buffer
+        struct abuf batch = jn->buf;
+        jn->buf = jn->spare;
+        jn->spare = batch;
+        long long rotate = jn->rotate;
+        jn->rotate = -1;
+        pthread_mutex_unlock(&jn->lock);
+
+        int err = editor_journal_write(jn->fd, batch.b, batch.len) == -1 ? errno : 0;
+        jn->written += batch.len;
+        if (rotate != -1 && editor_journal_rotate(jn, rotate) == -1)
+            err = errno;
+
+        pthread_mutex_lock(&jn->lock);
+        if (err)
+            jn->err = err;
+        jn->spare.len = 0;
+    }
+    pthread_mutex_unlock(&jn->lock);
+    return NULL;
+}
+
+/**
+ * Start journaling into fd, which is positioned at its end
+ */
+void editor_journal_start(int fd, long long len)
+{
+    struct journal *jn = &E.journal;
+    jn->fd = fd;
+    free(jn->filename);
+    jn->filename = xstrdup(E.filename);
+    jn->len = len;
+    jn->written = len;
+    jn->base = 0;
+    jn->rotate = -1;
+    jn->stop = false;
+    if (pthread_create(&jn->thread, NULL, editor_journal_worker, jn) != 0)
+    {
+        close(fd);
+        jn->fd = -1;
+        jn->disabled = true;
+    }
+}
+
+/**
+ * Create a fresh journal for the file being edited
+ */
+bool editor_journal_open()
+{
+    struct journal *jn = &E.journal;
+    if (jn->disabled || E.filename == NULL || E.readonly)
+        return false;
+
+    free(jn->path);
+    jn->path = editor_journal_path(E.filename);
+    int fd = open(jn->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    char header[MIM_JOURNAL_HEADER];
+    editor_journal_header(header, E.filename);
+    if (fd == -1 || write(fd, header, sizeof(header)) != sizeof(header))
+    {
+        if (fd != -1)
+            close(fd);
+        jn->disabled = true;
+        editor_set_status_message("Can't create recovery journal: %s", strerror(errno));
+        return false;
+    }
+    editor_journal_start(fd, 0);
+    return jn->fd != -1;
+}
+
+/**
+ * Queue a change for the recovery journal, see editor_undo_record
+ */
+void editor_journal_record(int type, int y, int x, const char *s, int len, const char *s2, int len2)
+{
+    struct journal *jn = &E.journal;
+    if (jn->replaying || (jn->fd == -1 && !editor_journal_open()))
+        return;
+
+    char header[MIM_JOURNAL_RECORD];
+    int fields[4] = {y, x, len, len2};
+    header[0] = type;
+    memcpy(header + 1, fields, sizeof(fields));
+
+    pthread_mutex_lock(&jn->lock);
+    // The flusher sleeps while there is nothing to write
+    if (jn->buf.len == 0)
+        pthread_cond_signal(&jn->cond);
+    ab_append(&jn->buf, header, sizeof(header));
+    ab_append(&jn->buf, s, len);
+    if (len2)
+        ab_append(&jn->buf, s2, len2);
+    pthread_mutex_unlock(&jn->lock);
+    jn->len += sizeof(header) + len + len2;
+}
+
+/**
+ * Start the journal over after a save, keeping only the changes made
+ * since the saved snapshot was taken. The flusher does the work
+ */
+void editor_journal_saved()
+{
+    struct journal *jn = &E.journal;
+    if (jn->fd == -1)
+        return;
+
+    pthread_mutex_lock(&jn->lock);
+    jn->rotate = jn->save_mark;
+    pthread_cond_signal(&jn->cond);
+    pthread_mutex_unlock(&jn->lock);
+}
+
+/**
+ * Stop the flusher after it writes out what is pending, deleting the
+ * journal if the buffer doesn't need recovering
+ */
+void editor_journal_close(bool remove)
+{
+    struct journal *jn = &E.journal;
+    if (jn->fd == -1)
+        return;
+
+    pthread_mutex_lock(&jn->lock);
+    jn->stop = true;
+    pthread_cond_signal(&jn->cond);
+    pthread_mutex_unlock(&jn->lock);
+    pthread_join(jn->thread, NULL);
+
+    close(jn->fd);
+    jn->fd = -1;
+    if (remove)
+        unlink(jn->path);
+}
+
+/**
+ * Replay the recovery journal on top of the file just opened,
+ * carrying on journaling into it
+ */
+void editor_journal_replay()
+{
+    struct journal *jn = &E.journal;
+    if (E.filename == NULL || E.readonly)
+        return;
+    free(jn->path);
+    jn->path = editor_journal_path(E.filename);
+
+    int fd = open(jn->path, O_RDWR);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        editor_set_status_message("No recovery journal for %s", E.filename);
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+
+    char *map = NULL;
+    if (st.st_size >= MIM_JOURNAL_HEADER)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    char header[MIM_JOURNAL_HEADER];
+    editor_journal_header(header, E.filename);
+    if (map == NULL || map == MAP_FAILED || memcmp(map, header, MIM_JOURNAL_HEADER) != 0)
+    {
+        // Replaying onto a different version of the file would garble it
+        editor_set_status_message("Recovery journal doesn't match %s, not replayed", E.filename);
+        if (map && map != MAP_FAILED)
+            munmap(map, st.st_size);
+        close(fd);
+        jn->disabled = true;
+        return;
+    }
+
+    // Replayed changes are already in the journal, and can't be undone
+    jn->replaying = true;
+    E.undo.applying = true;
+    long long off = MIM_JOURNAL_HEADER;
+    int count = 0;
+    while (off + MIM_JOURNAL_RECORD <= st.st_size)
+    {
+        int type = map[off];
+        int fields[4];
+        memcpy(fields, map + off + 1, sizeof(fields));
+        int y = fields[0], x = fields[1], len = fields[2], len2 = fields[3];
+        char *text = map + off + MIM_JOURNAL_RECORD;
+
+        // Stop at a record cut short by a crash, or one that doesn't fit
+        if (len < 0 || len2 < 0 || off + MIM_JOURNAL_RECORD + len + len2 > st.st_size)
+            break;
+        int rows = type == UNDO_INSERT_ROW || type == UNDO_INSERT_ROWS ? E.numrows + 1 : E.numrows;
+        if (type < UNDO_INSERT || type > UNDO_DELETE_ROWS || y < 0 || y >= rows)
+            break;
+        if (type == UNDO_DELETE_ROWS && (x < 1 || x > E.numrows - y))
+            break;
+        erow *row = type == UNDO_INSERT || type == UNDO_DELETE ? editor_row(y) : NULL;
+        if (row && (x < 0 || x > row->size || (type == UNDO_DELETE && len > row->size - x)))
+            break;
+
+        editor_apply_change(type, y, x, text, len, text + len, len2);
+        off += MIM_JOURNAL_RECORD + len + len2;
+        count++;
+    }
+    E.undo.applying = false;
+    jn->replaying = false;
+    munmap(map, st.st_size);
+
+    // Anything after the last good record is dropped
+    if (ftruncate(fd, off) == -1 || lseek(fd, off, SEEK_SET) == -1)
+    {
+        close(fd);
+        jn->disabled = true;
+    }
+    else
+    {
+        editor_journal_start(fd, off - MIM_JOURNAL_HEADER);
+    }
+    editor_set_status_message("Recovered %d changes from %s", count, jn->path);
+}
+
+/**
+ * Leave a journal found for the file alone unless asked to replay it
+ */
+void editor_journal_check(bool recover)
+{
+    if (E.filename == NULL || E.readonly || E.journal.disabled)
+        return;
+    if (recover)
+    {
+        editor_journal_replay();
+        return;
+    }
+
+    char *path = editor_journal_path(E.filename);
+    if (access(path, F_OK) == 0)
+    {
+        E.journal.disabled = true;
+        editor_set_status_message("Found %s, reopen with -r to recover it", path);
+    }
+    free(path);
+}
+
+/*** OUTPUT ***/
+
+/**
+ * Update row and column offsets based on cursor position
+ */
+void editor_scroll()
+{
+    E.rx = E.cx;
+    if (E.cy < E.numrows)
+    {
+        E.rx = editor_row_cx_to_rx(editor_row(E.cy), E.cx);
+    }
+    // Cursor is above visible window, scroll up
+    if (E.cy < E.rowoff)
+    {
+        E.rowoff = E.cy;
+    }
+    // Cursor is past visible window, scroll down
+    if (E.cy >= E.rowoff + E.screenrows)
+    {
+        E.rowoff = E.cy - E.screenrows + 1;
+    }
+
+    // Cursor is to the right of window, scroll right
+    if (E.rx < E.coloff)
+    {
+        E.coloff = E.rx;
+    }
+
+    // Cursor is to the left of window, scroll left
+    if (E.rx >= E.coloff + E.screencols + 1)
     {
-        if (row->chars[j] == '\t')
-            rx += (MIM_TAB_SIZE - 1) - (rx % MIM_TAB_SIZE);
-        rx++;
+        E.coloff = E.rx - E.screencols + 2;
     }
-    return rx;
 }
 
 /**
- * Update the render version of a row with proper tab handling
+ * Write a buffer to the terminal, retrying after partial writes
  */
-void editor_update_row(erow *row)
+void editor_write_all(const char *buf, int len)
+{
+    if (E.headless)
+    {
+        ab_append(&E.capture, buf, len);
+        return;
+    }
+    while (len > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n == -1)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/**
+ * Forget what the terminal shows so the next frame redraws everything
+ */
+void editor_invalidate_screen()
+{
+    int y;
+    for (y = 0; y < E.screenrows + 2; y++)
+        E.screen[y].len = -1;
+    E.screen_cy = -1;
+}
+
+/**
+ * Size the screen shadow for the current window, all lines unknown
+ */
+void editor_resize_screen()
+{
+    int y;
+    for (y = 0; y < E.screen_lines; y++)
+        free(E.screen[y].text);
+
+    E.screen_lines = E.screenrows + 2;
+    E.screen = xrealloc(E.screen, sizeof(struct screen_line) * E.screen_lines);
+    for (y = 0; y < E.screen_lines; y++)
+    {
+        E.screen[y].text = NULL;
+        E.screen[y].cap = 0;
+        E.screen[y].attr = 0;
+    }
+    editor_invalidate_screen();
+}
+
+/**
+ * Pick up a new window size after SIGWINCH
+ */
+void editor_handle_resize()
+{
+    E.resized = 0;
+    int rows, cols;
+    if (get_window_size(&rows, &cols) == -1)
+        return;
+
+    // Reserve two space for status bar
+    E.screenrows = rows > 3 ? rows - 2 : 1;
+    E.screencols = cols;
+    editor_resize_screen();
+}
+
+/**
+ * Screen columns len bytes of a line take, counting UTF-8 sequences as one
+ */
+int editor_screen_cols(const char *s, int len)
 {
-    int tabs = 0;
+    int cols = 0;
     int j;
-    for (j = 0; j < row->size; j++)
+    for (j = 0; j < len; j++)
     {
-        if (row->chars[j] == '\t')
-            tabs++;
+        if ((s[j] & 0xc0) != 0x80)
+            cols++;
     }
+    return cols;
+}
 
-    free(row->render);
-    // Tabs need max TAB_SIZE bytes, 1 is already in size so we add the rest
-    row->render = malloc(row->size + tabs * (MIM_TAB_SIZE - 1) + 1);
+/**
+ * Write the part of screen line y that differs from what is shown there
+ */
+void editor_draw_line(struct abuf *ab, int y, struct abuf *line, int attr)
+{
+    struct screen_line *old = &E.screen[y];
+    // Span of line to write, and whether to clear what is left after it
+    int start = 0;
+    int end = line->len;
+    bool clear = true;
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++)
+    if (old->len >= 0 && old->attr == attr)
+    {
+        // Skip the common prefix
+        while (start < line->len && start < old->len && line->b[start] == old->text[start])
+            start++;
+        if (start == line->len && start == old->len)
+            return;
+
+        // Bytes and columns differ for UTF-8, the common suffix is only
+        // in the same place on screen if both lines are as wide
+        int cols = editor_screen_cols(line->b, line->len);
+        int oldcols = editor_screen_cols(old->text, old->len);
+        if (line->len == old->len && cols == oldcols)
+        {
+            while (end > start && line->b[end - 1] == old->text[end - 1])
+                end--;
+        }
+        clear = cols < oldcols;
+
+        // Don't split UTF-8 sequences
+        while (start > 0 && (line->b[start] & 0xc0) == 0x80)
+            start--;
+        while (end < line->len && (line->b[end] & 0xc0) == 0x80)
+            end++;
+    }
+
+    int col = editor_screen_cols(line->b, start);
+
+    char buf[32];
+    int buflen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, col + 1);
+    ab_append(ab, buf, buflen);
+    // <Esc>[7m switches to invert color
+    // m - Select Graphic Rendition, 7 for invert
+    if (attr)
+        ab_append(ab, "\x1b[7m", 4);
+    if (end > start)
+        ab_append(ab, &line->b[start], end - start);
+    // Return to normal colors with <Esc>[m
+    if (attr)
+        ab_append(ab, "\x1b[m", 3);
+    // Clean rest of the line
+    if (clear)
+        ab_append(ab, "\x1b[K", 3);
+
+    // Remember what the line shows now
+    if (line->len > old->cap)
+    {
+        old->cap = line->len > old->cap * 2 ? line->len : old->cap * 2;
+        old->text = xrealloc(old->text, old->cap);
+    }
+    if (line->len)
+        memcpy(old->text, line->b, line->len);
+    old->len = line->len;
+    old->attr = attr;
+}
+
+/**
+ * Draw each row of text in the editor
+ */
+void editor_draw_rows(struct abuf *ab)
+{
+    struct abuf *line = &E.line;
+    int y;
+    for (y = 0; y < E.screenrows; y++)
+    {
+        // Each row is built on its own and then diffed against the screen
+        line->len = 0;
+        int filerow = y + E.rowoff;
+        if (filerow >= E.numrows)
+        {
+            // Display welcome if nothing is in rows buff
+            if (E.numrows == 0 && E.load == NULL && y == E.screenrows / 3)
+            {
+                char welcome[80];
+                int welcomelen = snprintf(welcome, sizeof(welcome), "MIM Text Editor -- version %s", MIM_VERSION);
+                if (welcomelen > E.screencols)
+                    welcomelen = E.screencols;
+                // Center
+                int padding = (E.screencols - welcomelen) / 2;
+                if (padding)
+                {
+                    ab_append(line, "~", 1);
+                    padding--;
+                }
+                ab_fill(line, ' ', padding);
+
+                ab_append(line, welcome, welcomelen);
+            }
+            else
+            {
+                // Write a tilde
+                ab_append(line, "~", 1);
+            }
+        }
+        else
+        {
+            erow *row = editor_row(filerow);
+            if (editor_row_long(row, row->size))
+            {
+                // Long rows are rendered from the chunk coloff is in
+                editor_long_draw(row, line, E.coloff, E.screencols);
+                editor_draw_line(ab, y, line, 0);
+                continue;
+            }
+            // Only rows on screen are ever rendered
+            int rsize;
+            char *render = editor_row_render(row, &rsize);
+            int len = rsize - E.coloff;
+            if (len < 0)
+                len = 0;
+            if (len > E.screencols)
+                len = E.screencols;
+            ab_append(line, &render[E.coloff], len);
+        }
+        editor_draw_line(ab, y, line, 0);
+    }
+}
+
+/**
+ * Draw the status bar at bottom of screen
+ */
+void editor_draw_status_bar(struct abuf *ab)
+{
+    struct abuf *line = &E.line;
+    line->len = 0;
+    char status[80], rstatus[80], loading[32] = "";
+
+    // How far the loader got, in MB when the size isn't known
+    const char *sep = E.dirty || E.readonly ? " " : "";
+    if (E.load && E.load->size > 0)
+        snprintf(loading, sizeof(loading), "%s[loading %d%%]", sep, (int)(E.load->loaded * 100 / E.load->size));
+    else if (E.load && E.load->loaded >= 1 << 20)
+        snprintf(loading, sizeof(loading), "%s[loading %lld MB]", sep, E.load->loaded >> 20);
+    else if (E.load)
+        snprintf(loading, sizeof(loading), "%s[loading %lld KB]", sep, E.load->loaded >> 10);
+
+    // Name of file and no. of lines
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s%s",
+                       E.filename ? E.filename : "[No name]",
+                       E.numrows,
+                       E.dirty ? "(modified)" : "",
+                       E.readonly ? "[read-only]" : "",
+                       loading);
+
+    // From the right, current position
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+
+    // Trim if bigger than screen
+    if (len > E.screencols)
+        len = E.screencols;
+
+    ab_append(line, status, len);
+    // Pad up to where the position ends at the edge of screen,
+    // dropping it when there is no room
+    if (E.screencols - len >= rlen)
+    {
+        ab_fill(line, ' ', E.screencols - len - rlen);
+        ab_append(line, rstatus, rlen);
+    }
+    else
+    {
+        ab_fill(line, ' ', E.screencols - len);
+    }
+    // Whole bar is drawn in inverted colors
+    editor_draw_line(ab, E.screenrows, line, 1);
+}
+
+/**
+ * Draw the message bar below status bar
+ */
+void editor_draw_message_bar(struct abuf *ab)
+{
+    struct abuf *line = &E.line;
+    line->len = 0;
+    if (E.prof.hud)
+    {
+        // The HUD takes over the message bar while it is on
+        struct profile *p = &E.prof;
+        char hud[160];
+        int len = snprintf(hud, sizeof(hud), "key %.2f scroll %.2f draw %.2f write %.2f save %.2f ms | %d B | %lld malloc %lld realloc",
+                           p->last[PROF_KEY], p->last[PROF_SCROLL], p->last[PROF_DRAW], p->last[PROF_WRITE],
+                           p->last[PROF_SAVE], E.frame_bytes, p->last_mallocs, p->last_reallocs);
+        ab_append(line, hud, len < E.screencols ? len : E.screencols);
+        editor_draw_line(ab, E.screenrows + 1, line, 0);
+        return;
+    }
+    int msglen = strlen(E.statusmsg);
+
+    // Trim for screen size
+    if (msglen > E.screencols)
+        msglen = E.screencols;
+
+    // There is a message and time hasn't expired
+    if (msglen && time(NULL) - E.statusmsg_time < MIM_MSG_TIMEOUT)
+        ab_append(line, E.statusmsg, msglen);
+    editor_draw_line(ab, E.screenrows + 1, line, 0);
+}
+
+/**
+ * Refresh the screen, writing only what changed since the last frame
+ */
+void editor_refresh_screen()
+{
+    struct prof_span frame = editor_prof_begin();
+    struct prof_span span = frame;
+    editor_scroll();
+    editor_prof_end(PROF_SCROLL, span);
+
+    struct abuf *ab = &E.frame;
+    ab->len = 0;
+
+    // Hide cursor
+    ab_append(ab, "\x1b[?25l", 6);
+    int header = ab->len;
+
+    span = editor_prof_begin();
+    editor_draw_rows(ab);
+    editor_draw_status_bar(ab);
+    editor_draw_message_bar(ab);
+    editor_prof_end(PROF_DRAW, span);
+
+    int cy = (E.cy - E.rowoff) + 1;
+    int cx = (E.rx - E.coloff) + 1;
+    if (ab->len == header && cy == E.screen_cy && cx == E.screen_cx)
+    {
+        // Nothing moved, nothing to write
+        E.frame_bytes = 0;
+        editor_prof_frame(0);
+        E.prof.paused += editor_prof_now() - frame.start;
+        return;
+    }
+
+    char buf[32];
+    // Draw the cursor at cy, cx
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy, cx);
+    ab_append(ab, buf, strlen(buf));
+    E.screen_cy = cy;
+    E.screen_cx = cx;
+
+    // Show cursor
+    ab_append(ab, "\x1b[?25h", 6);
+
+    // The whole frame goes out in one write
+    span = editor_prof_begin();
+    editor_write_all(ab->b, ab->len);
+    editor_prof_end(PROF_WRITE, span);
+    E.frame_bytes = ab->len;
+    editor_prof_frame(ab->len);
+    // Frames drawn by a prompt don't count towards the key that opened it
+    E.prof.paused += editor_prof_now() - frame.start;
+}
+
+/**
+ * Set status message with optional formatting
+ */
+void editor_set_status_message(const char *fmt, ...)
+{
+    va_list ap;
+    // Call va_start on a va_list object with fmt to get the address of next argument
+    va_start(ap, fmt);
+
+    // format the string according to fmt and stores it in E.statusmsg
+    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+
+    // clean up the va_list after we're done
+    va_end(ap);
+
+    // Pass null to time to get current time
+    E.statusmsg_time = time(NULL);
+}
+
+/*** REGEX ***/
+
+/**
+ * Add a node to the parse tree
+ */
+int re_node(struct regex *re, int type, int left, int right, int set)
+{
+    if (re->nnodes == re->nodescap)
+    {
+        re->nodescap = re->nodescap ? re->nodescap * 2 : 32;
+        re->nodes = xrealloc(re->nodes, sizeof(struct re_node) * re->nodescap);
+    }
+    struct re_node *node = &re->nodes[re->nnodes];
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    node->set = set;
+    return re->nnodes++;
+}
+
+/**
+ * Add an empty symbol set
+ */
+int re_set_new(struct regex *re)
+{
+    if (re->nsets == re->setscap)
+    {
+        re->setscap = re->setscap ? re->setscap * 2 : 16;
+        re->sets = xrealloc(re->sets, sizeof(*re->sets) * re->setscap);
+    }
+    memset(re->sets[re->nsets], 0, sizeof(*re->sets));
+    return re->nsets++;
+}
+
+/**
+ * Add a symbol to a set
+ */
+void re_set_add(struct regex *re, int set, int c)
+{
+    re->sets[set][c >> 3] |= 1 << (c & 7);
+}
+
+/**
+ * Check whether a set holds a symbol
+ */
+bool re_set_has(struct regex *re, int set, int c)
+{
+    return re->sets[set][c >> 3] & (1 << (c & 7));
+}
+
+/**
+ * Add the bytes of a \d, \w or \s class (or their negations) to a set.
+ * Returns false if c isn't a class letter
+ */
+bool re_set_escape(struct regex *re, int set, int c)
+{
+    int lower = tolower(c);
+    if (lower != 'd' && lower != 'w' && lower != 's')
+        return false;
+
+    int j;
+    for (j = 0; j < 256; j++)
+    {
+        bool in = lower == 'd' ? isdigit(j) : lower == 'w' ? isalnum(j) || j == '_' : isspace(j);
+        if (in != (c != lower))
+            re_set_add(re, set, j);
+    }
+    return true;
+}
+
+/**
+ * Byte an escape other than a class stands for
+ */
+int re_escape_char(int c)
+{
+    if (c == 't')
+        return '\t';
+    if (c == 'n')
+        return '\n';
+    return c;
+}
+
+/**
+ * Parse a bracket expression, p is just past the '['
+ */
+int re_parse_class(struct re_parser *ps)
+{
+    struct regex *re = ps->re;
+    int set = re_set_new(re);
+    bool negate = *ps->p == '^';
+    if (negate)
+        ps->p++;
+
+    // A ']' right at the start is a literal
+    bool first = true;
+    while (*ps->p && (*ps->p != ']' || first))
+    {
+        first = false;
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\' && *ps->p)
+        {
+            int c = (unsigned char)*ps->p++;
+            if (re_set_escape(re, set, c))
+                continue;
+            lo = re_escape_char(c);
+        }
+
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']')
+        {
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && *ps->p)
+                hi = re_escape_char((unsigned char)*ps->p++);
+            if (hi < lo)
+            {
+                ps->error = true;
+                return -1;
+            }
+        }
+        int c;
+        for (c = lo; c <= hi; c++)
+            re_set_add(re, set, c);
+    }
+    if (*ps->p != ']')
+    {
+        ps->error = true;
+        return -1;
+    }
+    ps->p++;
+
+    if (negate)
+    {
+        int j;
+        for (j = 0; j < 32; j++)
+            re->sets[set][j] ^= 0xff;
+    }
+    return re_node(re, RE_SET, -1, -1, set);
+}
+
+/**
+ * Parse a single character, class, group or anchor
+ */
+int re_parse_atom(struct re_parser *ps)
+{
+    struct regex *re = ps->re;
+    int c = (unsigned char)*ps->p++;
+    int set;
+    switch (c)
+    {
+    case '(':
     {
-        if (row->chars[j] == '\t')
+        int node = re_parse_alt(ps);
+        if (*ps->p != ')')
         {
-            row->render[idx++] = ' ';
-            // Append spaces until tabsize is hit
-            while (idx % MIM_TAB_SIZE != 0)
-                row->render[idx++] = ' ';
+            ps->error = true;
+            return -1;
         }
-        else
+        ps->p++;
+        return node;
+    }
+
+    case '[':
+        return re_parse_class(ps);
+
+    case '.':
+        set = re_set_new(re);
+        for (c = 0; c < 256; c++)
+            re_set_add(re, set, c);
+        return re_node(re, RE_SET, -1, -1, set);
+
+    // Anchors match the symbols fed in before and after the row
+    case '^':
+        set = re_set_new(re);
+        re_set_add(re, set, RE_BEGIN);
+        return re_node(re, RE_SET, -1, -1, set);
+
+    case '$':
+        set = re_set_new(re);
+        re_set_add(re, set, RE_END);
+        return re_node(re, RE_SET, -1, -1, set);
+
+    case '\\':
+        if (*ps->p == '\0')
         {
-            row->render[idx++] = row->chars[j];
+            ps->error = true;
+            return -1;
         }
+        c = (unsigned char)*ps->p++;
+        set = re_set_new(re);
+        if (!re_set_escape(re, set, c))
+            re_set_add(re, set, re_escape_char(c));
+        return re_node(re, RE_SET, -1, -1, set);
+
+    case '*':
+    case '+':
+    case '?':
+        // Nothing to repeat
+        ps->error = true;
+        return -1;
+
+    default:
+        set = re_set_new(re);
+        re_set_add(re, set, c);
+        return re_node(re, RE_SET, -1, -1, set);
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
 }
 
 /**
- * Add a new row to the editor buffer
+ * Parse an atom followed by any number of *, + and ?
  */
-void editor_insert_row(int at, char *s, size_t len)
+int re_parse_repeat(struct re_parser *ps)
 {
-    // Validate index at
-    if (at < 0 || at > E.numrows)
-        return;
-
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editor_update_row(&E.row[at]);
-    E.numrows++;
-    E.dirty++;
+    int node = re_parse_atom(ps);
+    while (!ps->error)
+    {
+        int type;
+        if (*ps->p == '*')
+            type = RE_STAR;
+        else if (*ps->p == '+')
+            type = RE_PLUS;
+        else if (*ps->p == '?')
+            type = RE_QUEST;
+        else
+            break;
+        ps->p++;
+        node = re_node(ps->re, type, node, -1, -1);
+    }
+    return node;
 }
 
 /**
- * Free memory allocated for a row
+ * Parse a sequence up to the next | or )
  */
-void editor_free_row(erow *row)
+int re_parse_cat(struct re_parser *ps)
 {
-    free(row->chars);
-    free(row->render);
+    int node = -1;
+    while (!ps->error && *ps->p && *ps->p != '|' && *ps->p != ')')
+    {
+        int next = re_parse_repeat(ps);
+        node = node == -1 ? next : re_node(ps->re, RE_CAT, node, next, -1);
+    }
+    if (node == -1)
+        node = re_node(ps->re, RE_EMPTY, -1, -1, -1);
+    return node;
 }
 
 /**
- * Delete a row at specified position
+ * Parse alternatives separated by |
  */
-void editor_del_row(int at)
+int re_parse_alt(struct re_parser *ps)
 {
-    // Validate row index
-    if (at < 0 || at > E.numrows)
-        return;
-    editor_free_row(&E.row[at]);
-    // Shift rows [at+1] to [at]
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    E.numrows--;
-    E.dirty++;
+    int node = re_parse_cat(ps);
+    while (!ps->error && *ps->p == '|')
+    {
+        ps->p++;
+        node = re_node(ps->re, RE_ALT, node, re_parse_cat(ps), -1);
+    }
+    return node;
 }
 
 /**
- * Insert a character into a row at specified position
+ * Append an instruction to the program, returns its pc
  */
-void editor_row_insert_char(erow *row, int at, int c)
+int re_emit(struct regex *re, int op, int x, int y)
 {
-    // Validate at index
-    if (at < 0 || at > row->size)
-        at = row->size;
-    // +1 for new char, +1 for '\0'
-    row->chars = realloc(row->chars, row->size + 2);
-    // Shift from [at] to [at+1]
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    // Rerender row
-    editor_update_row(row);
-    E.dirty++;
+    if (re->nprog == re->progcap)
+    {
+        re->progcap = re->progcap ? re->progcap * 2 : 32;
+        re->prog = xrealloc(re->prog, sizeof(struct re_inst) * re->progcap);
+    }
+    re->prog[re->nprog].op = op;
+    re->prog[re->nprog].x = x;
+    re->prog[re->nprog].y = y;
+    return re->nprog++;
 }
 
 /**
- * Append a string to end of specified row
+ * Compile a subtree into Thompson NFA instructions. The regex is
+ * compiled back to front, rows are scanned from their end
  */
-void editor_row_append_string(erow *row, char *s, size_t len)
+void re_compile_node(struct regex *re, int n)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    // Copy s at end of row
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
-    E.dirty++;
+    struct re_node node = re->nodes[n];
+    int split, jmp;
+    switch (node.type)
+    {
+    case RE_SET:
+        re_emit(re, RE_OP_SET, node.set, 0);
+        break;
+
+    case RE_CAT:
+        re_compile_node(re, node.right);
+        re_compile_node(re, node.left);
+        break;
+
+    case RE_ALT:
+        split = re_emit(re, RE_OP_SPLIT, 0, 0);
+        re->prog[split].x = re->nprog;
+        re_compile_node(re, node.left);
+        jmp = re_emit(re, RE_OP_JMP, 0, 0);
+        re->prog[split].y = re->nprog;
+        re_compile_node(re, node.right);
+        re->prog[jmp].x = re->nprog;
+        break;
+
+    case RE_STAR:
+        split = re_emit(re, RE_OP_SPLIT, 0, 0);
+        re->prog[split].x = re->nprog;
+        re_compile_node(re, node.left);
+        re_emit(re, RE_OP_JMP, split, 0);
+        re->prog[split].y = re->nprog;
+        break;
+
+    case RE_PLUS:
+        jmp = re->nprog;
+        re_compile_node(re, node.left);
+        split = re_emit(re, RE_OP_SPLIT, jmp, 0);
+        re->prog[split].y = re->nprog;
+        break;
+
+    case RE_QUEST:
+        split = re_emit(re, RE_OP_SPLIT, 0, 0);
+        re->prog[split].x = re->nprog;
+        re_compile_node(re, node.left);
+        re->prog[split].y = re->nprog;
+        break;
+    }
 }
 
 /**
- * Delete character at specified position in row
+ * Find the longest run of single bytes every match has to contain
  */
-void editor_row_del_char(erow *row, int at)
+void re_find_literal(struct regex *re, int n, char *run, int *runlen)
 {
-    if (at < 0 || at >= row->size)
+    struct re_node *node = &re->nodes[n];
+    if (node->type == RE_CAT)
+    {
+        re_find_literal(re, node->left, run, runlen);
+        re_find_literal(re, node->right, run, runlen);
         return;
-    // Shift from [at+1] to [at]
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editor_update_row(row);
-    E.dirty++;
-}
+    }
 
-/*** EDITOR OPERATIONS ***/
+    // A single byte, or x+ which starts with one and ends the run
+    int set = -1;
+    if (node->type == RE_SET)
+        set = node->set;
+    else if (node->type == RE_PLUS && re->nodes[node->left].type == RE_SET)
+        set = re->nodes[node->left].set;
+
+    int byte = -1;
+    if (set != -1)
+    {
+        int c;
+        for (c = 0; c < RE_SYMS; c++)
+        {
+            if (!re_set_has(re, set, c))
+                continue;
+            if (byte != -1 || c >= 256)
+            {
+                byte = -1;
+                break;
+            }
+            byte = c;
+        }
+    }
+
+    if (byte != -1 && *runlen < MIM_RE_LITERAL_MAX)
+    {
+        run[(*runlen)++] = byte;
+        if (*runlen > re->litlen)
+        {
+            memcpy(re->literal, run, *runlen);
+            re->litlen = *runlen;
+        }
+    }
+    if (byte == -1 || node->type == RE_PLUS)
+        *runlen = 0;
+}
 
 /**
- * Insert a character at current cursor position
+ * Add the instructions reachable from pc without consuming anything
  */
-void editor_insert_char(int c)
+void re_closure(struct regex *re, int pc, int *pcs, int *n)
 {
-    if (E.cy == E.numrows)
+    int *stack = re->stack;
+    int top = 0;
+    stack[top++] = pc;
+    while (top > 0)
     {
-        // Append a new row
-        editor_insert_row(E.numrows, " ", 0);
+        pc = stack[--top];
+        if (re->mark[pc] == re->markgen)
+            continue;
+        re->mark[pc] = re->markgen;
+
+        struct re_inst *inst = &re->prog[pc];
+        if (inst->op == RE_OP_JMP)
+        {
+            stack[top++] = inst->x;
+        }
+        else if (inst->op == RE_OP_SPLIT)
+        {
+            stack[top++] = inst->y;
+            stack[top++] = inst->x;
+        }
+        else
+        {
+            pcs[(*n)++] = pc;
+        }
     }
-    editor_row_insert_char(&E.row[E.cy], E.cx, c);
-    E.cx++;
 }
 
 /**
- * Insert a newline at current cursor position
+ * qsort comparison for instruction lists
  */
-void editor_insert_newline()
+int re_compare_int(const void *a, const void *b)
 {
-    if (E.cx == 0)
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Find or add the DFA state for a set of NFA instructions
+ */
+int re_dfa_state(struct regex *re, int *pcs, int n)
+{
+    qsort(pcs, n, sizeof(int), re_compare_int);
+
+    unsigned hash = 2166136261u;
+    int j;
+    for (j = 0; j < n; j++)
+        hash = (hash ^ pcs[j]) * 16777619u;
+
+    int slot = hash & (MIM_RE_DFA_STATES * 2 - 1);
+    while (re->hash[slot] != -1)
     {
-        editor_insert_row(E.cy, "", 0);
+        struct re_dstate *st = &re->states[re->hash[slot]];
+        if (st->n == n && memcmp(re->pool + st->off, pcs, sizeof(int) * n) == 0)
+            return re->hash[slot];
+        slot = (slot + 1) & (MIM_RE_DFA_STATES * 2 - 1);
     }
-    else
+
+    if (re->poollen + n > re->poolcap)
     {
-        erow *row = &E.row[E.cy];
-        // Insert a row below with the rest of the line contents
-        editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        // Reinitialize cause insert row rellocs
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editor_update_row(row);
+        while (re->poollen + n > re->poolcap)
+            re->poolcap = re->poolcap ? re->poolcap * 2 : 256;
+        re->pool = xrealloc(re->pool, sizeof(int) * re->poolcap);
     }
-    E.cy++;
-    E.cx = 0;
+    int s = re->nstates++;
+    struct re_dstate *st = &re->states[s];
+    st->off = re->poollen;
+    st->n = n;
+    st->match = false;
+    for (j = 0; j < n; j++)
+    {
+        re->pool[re->poollen++] = pcs[j];
+        if (re->prog[pcs[j]].op == RE_OP_MATCH)
+            st->match = true;
+    }
+    for (j = 0; j < re->nclasses; j++)
+        re->trans[s * re->nclasses + j] = -1;
+    re->accept[s * re->nclasses] = st->match;
+    re->hash[slot] = s;
+    return s;
 }
 
 /**
- * Delete character at current cursor position
+ * Drop every DFA state, keeping only the start state
  */
-void editor_del_char()
+void re_dfa_flush(struct regex *re)
 {
-    // Cursor past file, return
-    if (E.cy == E.numrows)
-        return;
-    // Cursor top of file, return
-    if (E.cx == 0 && E.cy == 0)
-        return;
+    re->nstates = 0;
+    re->poollen = 0;
+    int j;
+    for (j = 0; j < MIM_RE_DFA_STATES * 2; j++)
+        re->hash[j] = -1;
 
-    erow *row = &E.row[E.cy];
-    // Character to the left, then delete
-    if (E.cx > 0)
+    int n = 0;
+    re->markgen++;
+    re_closure(re, 0, re->step, &n);
+    re->start = re_dfa_state(re, re->step, n);
+}
+
+/**
+ * Work out the transition from a DFA state on a symbol class
+ */
+int re_dfa_next(struct regex *re, int s, int cls)
+{
+    int n;
+    // Out of room, start the cache over from this state
+    if (re->nstates == MIM_RE_DFA_STATES)
     {
-        editor_row_del_char(row, E.cx - 1);
-        E.cx--;
+        n = re->states[s].n;
+        memcpy(re->step, re->pool + re->states[s].off, sizeof(int) * n);
+        memcpy(re->flushed, re->step, sizeof(int) * n);
+        re_dfa_flush(re);
+        s = re_dfa_state(re, re->flushed, n);
     }
-    // If deleteing from first position, merge rows
-    else
+
+    int sym = re->rep[cls];
+    struct re_dstate *st = &re->states[s];
+    n = 0;
+    re->markgen++;
+    int j;
+    for (j = 0; j < st->n; j++)
     {
-        E.cx = E.row[E.cy - 1].size;
-        editor_row_append_string(&E.row[E.cy - 1], row->chars, row->size);
-        editor_del_row(E.cy);
-        E.cy--;
+        struct re_inst *inst = &re->prog[re->pool[st->off + j]];
+        if (inst->op == RE_OP_SET && re_set_has(re, inst->x, sym))
+            re_closure(re, re->pool[st->off + j] + 1, re->step, &n);
     }
+    int t = re_dfa_state(re, re->step, n);
+    re->trans[s * re->nclasses + cls] = t * re->nclasses;
+    return t;
 }
-/*** FILE IO ***/
 
 /**
- * Convert editor rows to a single string
+ * Free a compiled regex
  */
-char *editor_rows_to_string(int *buflen)
+void regex_free(struct regex *re)
 {
-    // Total length of text
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1; // +1 for \n
+    if (re == NULL)
+        return;
+    free(re->nodes);
+    free(re->sets);
+    free(re->prog);
+    free(re->mark);
+    free(re->stack);
+    free(re->step);
+    free(re->flushed);
+    free(re->states);
+    free(re->trans);
+    free(re->accept);
+    free(re->hash);
+    free(re->pool);
+    free(re);
+}
+
+/**
+ * Take a DFA transition, working it out the first time
+ */
+int re_dfa_step(struct regex *re, int s, int cls)
+{
+    int t = re->trans[s * re->nclasses + cls];
+    return t >= 0 ? t / re->nclasses : re_dfa_next(re, s, cls);
+}
 
-    // Set buflen to totlen to tell the caller of its size
-    *buflen = totlen;
+/**
+ * Check whether the regex matches an empty row, where ^ and $
+ * both hold and can be needed in any order
+ */
+bool re_match_empty(struct regex *re)
+{
+    int queue[MIM_RE_EMPTY_STATES];
+    int n = 0;
+    // Keep the states looked at below from being flushed
+    if (re->nstates > MIM_RE_DFA_STATES - 2 * MIM_RE_EMPTY_STATES)
+        re_dfa_flush(re);
+    queue[n++] = re->start;
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++)
+    int j;
+    for (j = 0; j < n; j++)
     {
-        // Loop thru, append each row to p + \n
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        // Point addition to move to last
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+        if (re->states[queue[j]].match)
+            return true;
+        int sym;
+        for (sym = RE_BEGIN; sym <= RE_END; sym++)
+        {
+            int t = re_dfa_step(re, queue[j], re->classes[sym]);
+            int k = 0;
+            while (k < n && queue[k] != t)
+                k++;
+            if (k == n && n < MIM_RE_EMPTY_STATES)
+                queue[n++] = t;
+        }
     }
-
-    return buf;
+    return false;
 }
+
 /**
- * Open and read a file into the editor buffer
+ * Compile a regular expression, NULL if it doesn't parse
  */
-void editor_open(char *filename)
+struct regex *regex_compile(const char *pattern)
 {
-    free(E.filename);
-    // Duplicate string instead of taking the reference
-    E.filename = strdup(filename);
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
+    struct regex *re = xcalloc(1, sizeof(struct regex));
+    struct re_parser ps = {pattern, re, false};
+    int root = re_parse_alt(&ps);
+    if (ps.error || *ps.p != '\0')
     {
-        // File doesn't exist, just set the filename without creating the file
-        // The file will be created when the user saves
-        // This message is actually overwritten by the help message
-        editor_set_status_message("New file: %s", filename);
-        return;
+        regex_free(re);
+        return NULL;
     }
 
-    char *line = NULL;
-    // Hold size of allocated buff
-    size_t linecap = 0;
-    // Hold length of line read
-    ssize_t linelen;
-    // getline reads one line + ending newline
-    // from file pointed by fp into memory pointed by line
-    // and sets linecap to the size it read
-    while ((linelen = getline(&line, &linecap, fp)) != -1)
+    // Unanchored: skip any tail of the row before the reversed regex
+    int any = re_set_new(re);
+    int c;
+    for (c = 0; c < RE_SYMS; c++)
+        re_set_add(re, any, c);
+    re_emit(re, RE_OP_SPLIT, 3, 1);
+    re_emit(re, RE_OP_SET, any, 0);
+    re_emit(re, RE_OP_JMP, 0, 0);
+    re_compile_node(re, root);
+    re_emit(re, RE_OP_MATCH, 0, 0);
+
+    // Symbols no set tells apart share a class, so the transition
+    // table only needs a column per class
+    for (c = 0; c < RE_SYMS; c++)
     {
-        // Trim all newlines and carriage returns
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
-        editor_insert_row(E.numrows, line, linelen);
+        bool same = c > 0 && c < 256;
+        int j;
+        for (j = 0; same && j < re->nsets; j++)
+            same = re_set_has(re, j, c) == re_set_has(re, j, c - 1);
+        if (!same)
+            re->rep[re->nclasses++] = c;
+        re->classes[c] = re->nclasses - 1;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+
+    char run[MIM_RE_LITERAL_MAX];
+    int runlen = 0;
+    re_find_literal(re, root, run, &runlen);
+
+    re->mark = xcalloc(re->nprog, sizeof(int));
+    re->stack = xmalloc(sizeof(int) * (re->nprog * 2 + 2));
+    re->step = xmalloc(sizeof(int) * re->nprog);
+    re->flushed = xmalloc(sizeof(int) * re->nprog);
+    re->states = xmalloc(sizeof(struct re_dstate) * MIM_RE_DFA_STATES);
+    re->trans = xmalloc(sizeof(int) * MIM_RE_DFA_STATES * re->nclasses);
+    re->accept = xmalloc(MIM_RE_DFA_STATES * re->nclasses);
+    re->hash = xmalloc(sizeof(int) * MIM_RE_DFA_STATES * 2);
+    re_dfa_flush(re);
+    return re;
 }
 
 /**
- * Save current file to disk
+ * Find where a match of the regex starts in a row, searching from
+ * column from in direction dir like editor_row_find. Returns -1 if none
  */
-void editor_save()
+int regex_row_find(struct regex *re, erow *row, int from, int dir)
 {
-    if (E.filename == NULL)
+    if (dir > 0 && from > row->size)
+        return -1;
+    if (row->size == 0)
+        return (dir > 0 || from >= 0) && re_match_empty(re) ? 0 : -1;
+    // Rows without the required literal can't match
+    if (re->litlen > 0 && editor_row_find(row, dir > 0 ? from : 0, re->literal, re->litlen, 1) == -1)
+        return -1;
+
+    // The reversed DFA reads the row from its end, it accepts at column
+    // i when some match starts there
+    int stop = dir > 0 ? (from < 0 ? 0 : from) : 0;
+    int found = -1;
+
+    // Anchors are zero width, so their symbol is fed until the state
+    // settles, once for every $ the regex could need
+    int s = re->start;
+    int prev, j;
+    for (j = 0; j <= re->nprog; j++)
     {
-        E.filename = editor_prompt("Save as: %s");
-        if (E.filename == NULL)
+        prev = s;
+        s = re_dfa_step(re, s, re->classes[RE_END]);
+        if (s == prev)
+            break;
+    }
+    if (re->states[s].match)
+    {
+        // Empty match at the end of the row
+        if (dir > 0)
+            found = row->size;
+        else if (row->size <= from)
+            return row->size;
+    }
+
+    // Tables are read through locals, row text could alias the struct
+    const unsigned char *chars = (const unsigned char *)editor_row_chars(row);
+    const int *classes = re->classes;
+    const int *trans = re->trans;
+    const char *accept = re->accept;
+    int nclasses = re->nclasses;
+    int off = s * nclasses;
+    int i;
+    for (i = row->size - 1; i >= stop; i--)
+    {
+        int cls = classes[chars[i]];
+        int t = trans[off + cls];
+        off = t >= 0 ? t : re_dfa_next(re, off / nclasses, cls) * nclasses;
+        if (accept[off])
         {
-            editor_set_status_message("Save aborted");
-            return;
+            if (dir > 0)
+                found = i;
+            else if (i <= from)
+                return i;
         }
     }
+    s = off / nclasses;
 
-    // Length of file string
-    int len;
-    // buf has a pointer to the converted memory that we free later
-    char *buf = editor_rows_to_string(&len);
+    // Matches that need ^ only start at column 0
+    if (stop == 0 && (dir > 0 || from >= 0))
+    {
+        for (j = 0; j <= re->nprog; j++)
+        {
+            prev = s;
+            s = re_dfa_step(re, s, re->classes[RE_BEGIN]);
+            if (re->states[s].match)
+            {
+                found = 0;
+                break;
+            }
+            if (s == prev)
+                break;
+        }
+    }
+    return found;
+}
 
-    // Check if file already exists to differentiate messages
-    int file_exists = access(E.filename, F_OK) == 0;
+/*** FIND ***/
 
-    // O_READWRITE
-    // O_CREATE file if doesn't exist
-    // 0644 file perms if file is to be created
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1)
+/**
+ * Find query in a row starting at column from and going in direction dir
+ * (1 forwards, -1 backwards). Returns the column of the match or -1
+ */
+int editor_row_find(erow *row, int from, const char *query, int qlen, int dir)
+{
+    // Last column a match can start at
+    int last = row->size - qlen;
+    if (qlen == 0 || last < 0)
+        return -1;
+
+    // Candidates have to match the first and last byte of the query,
+    // only those get the full compare
+    char first = query[0];
+    char tail = query[qlen - 1];
+    char *chars = editor_row_chars(row);
+    if (dir > 0)
     {
-        if (ftruncate64(fd, len) != -1)
+        if (from < 0)
+            from = 0;
+        if (from > last)
+            return -1;
+        char *p = chars + from;
+        char *end = chars + last + 1;
+#ifdef __SSE2__
+        // Check 16 starting positions at once, comparing the first byte
+        // at each and the last byte qlen - 1 further on. A short last
+        // block is redone overlapping the one before, so only spans under
+        // 16 positions fall through to memchr
+        __m128i vfirst = _mm_set1_epi8(first);
+        __m128i vtail = _mm_set1_epi8(tail);
+        char *start = p;
+        while (p < end)
         {
-            if (write(fd, buf, len) == len)
+            if (end - p < 16)
             {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-
-                if (!file_exists)
-                {
-                    editor_set_status_message("New file created: %s. %d bytes written to disk", E.filename, len);
-                }
-                else
-                {
-                    editor_set_status_message("%d bytes written to disk", len);
-                }
-                return;
+                if (end - start < 16)
+                    break;
+                p = end - 16;
+            }
+            __m128i a = _mm_loadu_si128((const __m128i *)p);
+            __m128i b = _mm_loadu_si128((const __m128i *)(p + qlen - 1));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, vfirst), _mm_cmpeq_epi8(b, vtail)));
+            while (mask)
+            {
+                int bit = __builtin_ctz(mask);
+                if (memcmp(p + bit, query, qlen) == 0)
+                    return p + bit - chars;
+                mask &= mask - 1;
             }
+            p += 16;
+        }
+#endif
+        // memchr finds candidates for the first byte a word or vector at a time
+        while (p < end && (p = memchr(p, first, end - p)) != NULL)
+        {
+            if (p[qlen - 1] == tail && memcmp(p, query, qlen) == 0)
+                return p - chars;
+            p++;
+        }
+    }
+    else
+    {
+        if (from > last)
+            from = last;
+        int len = from + 1;
+        char *p;
+        while (len > 0 && (p = memrchr(chars, first, len)) != NULL)
+        {
+            if (p[qlen - 1] == tail && memcmp(p, query, qlen) == 0)
+                return p - chars;
+            len = p - chars;
         }
-        close(fd);
     }
-    free(buf);
-    editor_set_status_message("Failed to save! I/O error: %s", strerror(errno));
+    return -1;
 }
-// Define a single string buffer to update at once
-// Append buffer
-struct abuf
-{
-    char *b;
-    int len;
-};
 
-// Constructor
-#define ABUT_INIT {NULL, 0}
+/**
+ * Move the cursor to a match, scrolling it into view if needed
+ */
+void editor_find_show(int row, int col)
+{
+    E.cy = row;
+    E.cx = col;
+    if (E.cy < E.rowoff || E.cy >= E.rowoff + E.screenrows)
+    {
+        // Land a third of the way down so the context shows
+        E.rowoff = E.cy - E.screenrows / 3;
+        if (E.rowoff < 0)
+            E.rowoff = 0;
+    }
+}
 
 /**
- * Append string to append buffer
+ * Continue the pending scan for a while, giving up the rest to later calls
+ * so no keystroke waits for more than about a frame
  */
-void ab_append(struct abuf *ab, const char *s, int len)
+void editor_find_scan()
 {
-    // Realloc bigger mem as required
-    char *new = realloc(ab->b, ab->len + len);
+    struct find_state *f = &E.find;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    if (new == NULL)
-        return;
-    // Append and update buf
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    int n = 0;
+    while (f->scanning && f->left > 0)
+    {
+        erow *row = editor_row(f->row);
+        editor_row_close_gap(row);
+        int col;
+        if (f->regex)
+            col = regex_row_find(f->re, row, f->col, f->dir);
+        else
+            col = editor_row_find(row, f->col, f->query, f->qlen, f->dir);
+        if (col != -1)
+        {
+            f->scanning = false;
+            f->match_row = f->row;
+            f->match_col = col;
+            editor_find_show(f->row, col);
+            return;
+        }
+
+        // Next row, wrapping around the buffer
+        f->left--;
+        f->row += f->dir;
+        if (f->row == E.numrows)
+            f->row = 0;
+        else if (f->row < 0)
+            f->row = E.numrows - 1;
+        f->col = f->dir > 0 ? 0 : INT_MAX;
+
+        if (++n % 1024 == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (ms >= MIM_FIND_BUDGET)
+                return;
+        }
+    }
+    // Went all the way round
+    f->scanning = false;
 }
 
 /**
- * Free memory used by append buffer
+ * Start a scan for query at (row, col), covering every row once
  */
-void ab_free(struct abuf *ab)
+void editor_find_start(char *query, int row, int col, int dir)
 {
-    free(ab->b);
-}
+    struct find_state *f = &E.find;
+    int qlen = strlen(query);
+    if (f->regex && (f->re == NULL || qlen != f->qlen || memcmp(query, f->query, qlen) != 0))
+    {
+        regex_free(f->re);
+        f->re = regex_compile(query);
+    }
 
-/*** OUTPUT ***/
+    f->qlen = qlen;
+    if (f->qlen >= f->querycap)
+    {
+        f->querycap = f->qlen + 1;
+        f->query = xrealloc(f->query, f->querycap);
+    }
+    memcpy(f->query, query, f->qlen + 1);
+
+    f->scanning = f->qlen > 0 && E.numrows > 0 && (!f->regex || f->re);
+    f->row = row < E.numrows ? row : 0;
+    f->col = col;
+    f->dir = dir;
+    // The start row is visited again at the end for matches before col
+    f->left = E.numrows + 1;
+    editor_find_scan();
+}
 
 /**
- * Update row and column offsets based on cursor position
+ * Prompt callback, searches as the query is typed
  */
-void editor_scroll()
+void editor_find_callback(char *query, int key)
 {
-    E.rx = E.cx;
-    if (E.cy < E.numrows)
+    struct find_state *f = &E.find;
+    if (key == '\r' || key == '\x1b')
     {
-        E.rx = editor_row_cx_to_rx(&E.row[E.cy], E.cx);
+        f->scanning = false;
+        return;
     }
-    // Cursor is above visible window, scroll up
-    if (E.cy < E.rowoff)
+
+    int qlen = strlen(query);
+    if (key == REFRESH_KEY)
     {
-        E.rowoff = E.cy;
+        // Idle, carry on with a scan that ran out of time
+        if (f->scanning)
+            editor_find_scan();
     }
-    // Cursor is past visible window, scroll down
-    if (E.cy >= E.rowoff + E.screenrows)
+    else if (key == ARROW_RIGHT || key == ARROW_DOWN)
     {
-        E.rowoff = E.cy - E.screenrows + 1;
+        if (f->match_row != -1)
+            editor_find_start(query, f->match_row, f->match_col + 1, 1);
+    }
+    else if (key == ARROW_LEFT || key == ARROW_UP)
+    {
+        if (f->match_row != -1)
+            editor_find_start(query, f->match_row, f->match_col - 1, -1);
+    }
+    else if (!f->regex && f->qlen > 0 && qlen > f->qlen && strncmp(query, f->query, f->qlen) == 0)
+    {
+        // Query only grew, nothing before the current match or scan
+        // position can match it, so carry on from there
+        if (f->match_row != -1)
+            editor_find_start(query, f->match_row, f->match_col, 1);
+        else if (f->scanning)
+            editor_find_start(query, f->row, f->col, f->dir);
+    }
+    else
+    {
+        // Query changed some other way, search again from where we started
+        f->match_row = -1;
+        editor_find_start(query, E.find.origin_cy, E.find.origin_cx, 1);
     }
 
-    // Cursor is to the right of window, scroll right
-    if (E.rx < E.coloff)
+    // Remember the query even when the scan above was skipped
+    if (qlen != f->qlen || strcmp(query, f->query) != 0)
     {
-        E.coloff = E.rx;
+        if (qlen >= f->querycap)
+        {
+            f->querycap = qlen + 1;
+            f->query = xrealloc(f->query, f->querycap);
+        }
+        memcpy(f->query, query, qlen + 1);
+        f->qlen = qlen;
     }
+}
 
-    // Cursor is to the left of window, scroll left
-    if (E.rx >= E.coloff + E.screencols + 1)
+/**
+ * Incremental search for a string or a regex,
+ * restores the cursor if cancelled
+ */
+void editor_find(bool regex)
+{
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+
+    E.find.origin_cx = E.cx;
+    E.find.origin_cy = E.cy;
+    E.find.match_row = -1;
+    E.find.qlen = 0;
+    E.find.scanning = false;
+    E.find.regex = regex;
+
+    char *prompt = regex ? "Regex search: %s (Use ESC/Arrows/Enter)" : "Search: %s (Use ESC/Arrows/Enter)";
+    char *query = editor_prompt(prompt, editor_find_callback, false);
+    if (query)
     {
-        E.coloff = E.rx - E.screencols + 2;
+        free(query);
+    }
+    else
+    {
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
     }
 }
 
 /**
- * Draw each row of text in the editor
+ * Rewrite every row of a chunk that contains the query, starting
+ * from its leaf so workers never touch the shared lookup hint
  */
-void editor_draw_rows(struct abuf *ab)
+void *editor_replace_worker(void *arg)
 {
-    int y;
-    for (y = 0; y < E.screenrows; y++)
+    struct replace_chunk *chunk = arg;
+    rows_node *leaf = chunk->leaf;
+    int slot = chunk->slot;
+    int qlen = chunk->qlen;
+    int wlen = chunk->wlen;
+
+    // Match columns of the row being looked at
+    int *cols = NULL;
+    int ncols = 0, colscap = 0;
+
+    int left;
+    for (left = chunk->count; left > 0; left--)
     {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numrows)
+        if (slot == leaf->n)
         {
-            // Display welcome if nothing is in rows buff
-            if (E.numrows == 0 && y == E.screenrows / 3)
-            {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome), "MIM Text Editor -- version %s", MIM_VERSION);
-                if (welcomelen > E.screencols)
-                    welcomelen = E.screencols;
-                // Center
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding)
-                {
-                    ab_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                    ab_append(ab, " ", 1);
+            leaf = leaf->next;
+            slot = 0;
+        }
+        erow *row = &leaf->u.rows[slot++];
 
-                ab_append(ab, welcome, welcomelen);
-            }
-            else
+        ncols = 0;
+        int col = 0;
+        while ((col = editor_row_find(row, col, chunk->query, qlen, 1)) != -1)
+        {
+            if (ncols == colscap)
             {
-                // Write a tilde
-                ab_append(ab, "~", 1);
+                colscap = colscap ? colscap * 2 : 16;
+                cols = xrealloc(cols, sizeof(int) * colscap);
             }
+            cols[ncols++] = col;
+            col += qlen;
         }
-        else
+        if (ncols == 0)
+            continue;
+
+        // Build the new text in one allocation
+        char *text = editor_row_chars(row);
+        int size = row->size + ncols * (wlen - qlen);
+        char *chars = xmalloc(size + 1);
+        char *p = chars;
+        int prev = 0;
+        int j;
+        for (j = 0; j < ncols; j++)
         {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0)
-                len = 0;
-            if (len > E.screencols)
-                len = E.screencols;
-            ab_append(ab, &E.row[filerow].render[E.coloff], len);
+            memcpy(p, text + prev, cols[j] - prev);
+            p += cols[j] - prev;
+            memcpy(p, chunk->with, wlen);
+            p += wlen;
+            prev = cols[j] + qlen;
         }
-        // Clean row as we write
-        ab_append(ab, "\x1b[K", 3);
+        memcpy(p, text + prev, row->size - prev);
+        chars[size] = '\0';
 
-        // Append newline
-        ab_append(ab, "\r\n", 2);
+        if (chunk->nedits == chunk->editscap)
+        {
+            chunk->editscap = chunk->editscap ? chunk->editscap * 2 : 64;
+            chunk->edits = xrealloc(chunk->edits, sizeof(struct replace_edit) * chunk->editscap);
+        }
+        struct replace_edit *edit = &chunk->edits[chunk->nedits++];
+        edit->y = chunk->first + chunk->count - left;
+        edit->chars = chars;
+        edit->size = size;
+        chunk->matches += ncols;
     }
+    free(cols);
+    return NULL;
 }
 
 /**
- * Draw the status bar at bottom of screen
+ * Replace every occurrence of query with with. Rows are searched and
+ * rewritten in parallel, then swapped in as one edit
  */
-void editor_draw_status_bar(struct abuf *ab)
+void editor_replace_all(char *query, char *with)
 {
-    // <Esc>[7m switches to invert color
-    // m - Select Graphic Rendition, 7 for invert
-    ab_append(ab, "\x1b[7m", 4);
+    if (E.numrows == 0)
+        return;
 
-    char status[80], rstatus[80];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nchunks = E.numrows / MIM_REPLACE_MIN_ROWS;
+    if (nchunks > ncpu)
+        nchunks = ncpu;
+    if (nchunks > MIM_REPLACE_THREADS)
+        nchunks = MIM_REPLACE_THREADS;
+    if (nchunks < 1)
+        nchunks = 1;
 
-    // Name of file and no. of lines
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                       E.filename ? E.filename : "[No name]",
-                       E.numrows,
-                       E.dirty ? "(modified)" : "");
+    // Workers read chars directly
+    editor_close_gaps();
 
-    // From the right, current position
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+    struct replace_chunk chunks[MIM_REPLACE_THREADS];
+    int per = (E.numrows + nchunks - 1) / nchunks;
+    int j;
+    for (j = 0; j < nchunks; j++)
+    {
+        struct replace_chunk *chunk = &chunks[j];
+        int first = j * per;
+        // Looking up the first row leaves its leaf in the hint
+        editor_row(first);
+        chunk->leaf = E.rows_hint;
+        chunk->slot = first - E.rows_hint_base;
+        chunk->first = first;
+        chunk->count = first + per > E.numrows ? E.numrows - first : per;
+        chunk->query = query;
+        chunk->qlen = strlen(query);
+        chunk->with = with;
+        chunk->wlen = strlen(with);
+        chunk->edits = NULL;
+        chunk->nedits = chunk->editscap = 0;
+        chunk->matches = 0;
+        chunk->threaded = j > 0 && pthread_create(&chunk->thread, NULL, editor_replace_worker, chunk) == 0;
+    }
 
-    // Trim if bigger than screen
-    if (len > E.screencols)
-        len = E.screencols;
+    // The first chunk, and any a thread couldn't be started for, run here
+    for (j = 0; j < nchunks; j++)
+    {
+        if (chunks[j].threaded)
+            continue;
+        editor_replace_worker(&chunks[j]);
+    }
+    // Looking rows up may copy leaves a save shares, which relinks the
+    // leaves the workers walk, so they all finish first
+    for (j = 0; j < nchunks; j++)
+    {
+        if (chunks[j].threaded)
+            pthread_join(chunks[j].thread, NULL);
+    }
 
-    ab_append(ab, status, len);
-    while (len < E.screencols)
+    // Swap the new text in, each row touched once
+    long matches = 0;
+    int rows = 0;
+    for (j = 0; j < nchunks; j++)
     {
-        // Go till we hit the space where the edge of screen is
-        // rlen characters long
-        if (E.screencols - len == rlen)
-        {
-            ab_append(ab, rstatus, rlen);
-            break;
-        }
-        else
+        struct replace_chunk *chunk = &chunks[j];
+        int k;
+        for (k = 0; k < chunk->nedits; k++)
         {
-            ab_append(ab, " ", 1);
+            struct replace_edit *edit = &chunk->edits[k];
+            erow *row = editor_row(edit->y);
+            editor_note_change(UNDO_SET_ROW, edit->y, 0, editor_row_chars(row), row->size, edit->chars, edit->size);
+            if (row->flags & ROW_LONG)
+                editor_long_free(row);
+            editor_free_chars(row);
+            memcpy(editor_row_alloc(row, edit->size + 1), edit->chars, edit->size + 1);
+            free(edit->chars);
+            row->size = edit->size;
+            editor_update_row(row);
         }
-        len++;
+        free(chunk->edits);
+        matches += chunk->matches;
+        rows += chunk->nedits;
     }
-    // Return to normal colors with <Esc>[m
-    ab_append(ab, "\x1b[m", 3);
-    ab_append(ab, "\r\n", 2);
-}
-
-/**
- * Draw the message bar below status bar
- */
-void editor_draw_message_bar(struct abuf *ab)
-{
-    // Clear bar with K
-    ab_append(ab, "\x1b[K", 3);
-
-    int msglen = strlen(E.statusmsg);
 
-    // Trim for screen size
-    if (msglen > E.screencols)
-        msglen = E.screencols;
+    if (matches == 0)
+    {
+        editor_set_status_message("No match for %s", query);
+        return;
+    }
 
-    // There is a message and time hasn't expired
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
-        ab_append(ab, E.statusmsg, msglen);
+    E.dirty++;
+    erow *row = editor_row(E.cy);
+    if (row && E.cx > row->size)
+        E.cx = row->size;
+    editor_set_status_message("Replaced %ld occurrences in %d lines", matches, rows);
 }
 
 /**
- * Refresh the entire screen contents
+ * Ask for a query and its replacement and replace all occurrences
  */
-void editor_refresh_screen()
+void editor_replace()
 {
-    editor_scroll();
-
-    struct abuf ab = ABUT_INIT;
-
-    // Hide cursor
-    ab_append(&ab, "\x1b[?25l", 6);
-    // Position cursor to top left with H, no args
-    ab_append(&ab, "\x1b[H", 3);
-
-    editor_draw_rows(&ab);
-    editor_draw_status_bar(&ab);
-    editor_draw_message_bar(&ab);
-
-    char buf[32];
-    // Draw the cursor at cy, cx
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    ab_append(&ab, buf, strlen(buf));
+    if (editor_check_readonly())
+        return;
 
-    // Show cursor
-    ab_append(&ab, "\x1b[?25h", 6);
+    char *query = editor_prompt("Replace: %s (ESC to cancel)", NULL, false);
+    if (query == NULL)
+        return;
+    char *with = editor_prompt("Replace with: %s (ESC to cancel)", NULL, true);
+    if (with == NULL)
+    {
+        free(query);
+        return;
+    }
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    ab_free(&ab);
+    // Occurrences in lines still being read count too
+    editor_load_finish();
+    editor_replace_all(query, with);
+    free(query);
+    free(with);
 }
 
+/*** INPUT  ***/
+
 /**
- * Set status message with optional formatting
+ * Get on with background work while nothing is typed
  */
-void editor_set_status_message(const char *fmt, ...)
+void editor_idle()
 {
-    va_list ap;
-    // Call va_start on a va_list object with fmt to get the address of next argument
-    va_start(ap, fmt);
-
-    // format the string according to fmt and stores it in E.statusmsg
-    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-
-    // clean up the va_list after we're done
-    va_end(ap);
-
-    // Pass null to time to get current time
-    E.statusmsg_time = time(NULL);
+    editor_load_step(false);
+    editor_text_compact();
 }
 
-/*** INPUT  ***/
-
 /**
- * Prompt user for input and return entered text
+ * Prompt user for input and return entered text, empty text only if
+ * empty is set. Callback (if any) is called with the text after every key
  */
-char *editor_prompt(char *prompt)
+char *editor_prompt(char *prompt, void (*callback)(char *, int), bool empty)
 {
     size_t bufsize = 128;
-    char *buf = malloc(bufsize);
+    char *buf = xmalloc(bufsize);
 
     size_t buflen = 0;
     buf[0] = '\0';
@@ -897,7 +6716,11 @@ char *editor_prompt(char *prompt)
         editor_refresh_screen();
 
         int c = editor_read_key();
-        if (c == DEL_KEY || c == CTRL_KEY('h' || c == BACKSPACE))
+        if (c == REFRESH_KEY)
+        {
+            editor_idle();
+        }
+        else if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
         {
             if (buflen != 0)
                 buf[--buflen] = '\0';
@@ -905,15 +6728,18 @@ char *editor_prompt(char *prompt)
         else if (c == '\x1b')
         {
             editor_set_status_message("");
+            if (callback)
+                callback(buf, c);
             free(buf);
             return NULL;
         }
         else if (c == '\r')
         {
-            // buf is not empty
-            if (buflen != 0)
+            if (buflen != 0 || empty)
             {
                 editor_set_status_message("");
+                if (callback)
+                    callback(buf, c);
                 return buf;
             }
         }
@@ -924,11 +6750,31 @@ char *editor_prompt(char *prompt)
             if (buflen == bufsize - 1)
             {
                 bufsize *= 2;
-                buf = realloc(buf, bufsize);
+                buf = xrealloc(buf, bufsize);
             }
             buf[buflen++] = c;
             buf[buflen] = '\0';
         }
+        // Pasted text, keep the printable part of its first line
+        else if (c == PASTE_KEY)
+        {
+            int j;
+            for (j = 0; j < E.paste.len && E.paste.b[j] != '\r' && E.paste.b[j] != '\n'; j++)
+            {
+                if (iscntrl((unsigned char)E.paste.b[j]))
+                    continue;
+                if (buflen == bufsize - 1)
+                {
+                    bufsize *= 2;
+                    buf = xrealloc(buf, bufsize);
+                }
+                buf[buflen++] = E.paste.b[j];
+            }
+            buf[buflen] = '\0';
+        }
+
+        if (callback)
+            callback(buf, c);
     }
 }
 
@@ -941,7 +6787,7 @@ void editor_move_cursor(int key)
     // If it is out of bounds, set row to NULL.
     // Ensures that the cursor does not move beyond the available rows.
 
-    erow *row = (E.cy < E.numrows) ? &E.row[E.cy] : NULL;
+    erow *row = editor_row(E.cy);
 
     switch (key)
     {
@@ -953,7 +6799,7 @@ void editor_move_cursor(int key)
             // Move up to previous line
             E.cy--;
             // At the end of line
-            E.cx = E.row[E.cy].size;
+            E.cx = editor_row(E.cy)->size;
         }
         break;
     case ARROW_DOWN:
@@ -980,7 +6826,7 @@ void editor_move_cursor(int key)
     }
 
     // Reset init row and do the same for horizontal
-    row = (E.cy < E.numrows) ? &E.row[E.cy] : NULL;
+    row = editor_row(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen)
     {
@@ -988,20 +6834,47 @@ void editor_move_cursor(int key)
     }
 }
 
+/**
+ * Prompt for a line number and jump the cursor to it
+ */
+void editor_goto_line()
+{
+    char *input = editor_prompt("Go to line: %s", NULL, false);
+    if (input == NULL)
+        return;
+
+    int line = atoi(input);
+    free(input);
+    if (line < 1)
+        line = 1;
+    if (line > E.numrows)
+        line = E.numrows;
+
+    // Row lookup is a tree descent, so this is cheap on any file size
+    E.cy = line > 0 ? line - 1 : 0;
+    E.cx = 0;
+}
+
 /**
  * Process keyboard input and handle special keys
  */
 void editor_process_keypress()
 {
     static int quit_times = MIM_QUIT_TIMES;
+    struct prof_span span = editor_prof_begin();
     int c = editor_read_key();
 
     // Reset quit_times to MIM_QUIT_TIMES if the key pressed is not CTRL-Q
-    if (c != CTRL_KEY('q'))
+    if (c != CTRL_KEY('q') && c != REFRESH_KEY)
     {
         quit_times = MIM_QUIT_TIMES;
     }
 
+    // Every key starts a new undo step, typing runs are merged again
+    // by editor_undo_record
+    if (c != REFRESH_KEY)
+        editor_undo_seal();
+
     switch (c)
     {
     // Enter key
@@ -1010,19 +6883,22 @@ void editor_process_keypress()
         break;
 
     case CTRL_KEY('q'):
+        // A save still being written has to finish first
+        editor_finish_save(true);
         // Clear screen
         if (E.dirty && quit_times > 0)
         {
             editor_set_status_message("WARNING: File has unsaved changes. Press CTRL-Q again to quit.");
             quit_times--;
-            return;
+            break;
         }
-        write(STDOUT_FILENO, "\x1b[2J", 4);
-        write(STDOUT_FILENO, "\x1b[H", 3);
+        // Quitting on purpose, nothing left to recover
+        editor_journal_close(true);
+        editor_write_all("\x1b[2J\x1b[H", 7);
         exit(0);
         break;
     case CTRL_KEY('d'):
-	if (E.cy < E.numrows) {
+	if (E.cy < E.numrows && !editor_check_readonly()) {
 		editor_del_row(E.cy);
 		if (E.cy >= E.numrows && E.numrows > 0){
 			E.cy = E.numrows -1;
@@ -1031,7 +6907,54 @@ void editor_process_keypress()
 	}
 	break;
     case CTRL_KEY('s'):
+    {
+        struct prof_span save = editor_prof_begin();
         editor_save();
+        editor_prof_end(PROF_SAVE, save);
+    }
+    break;
+    case CTRL_KEY('g'):
+        editor_goto_line();
+        break;
+
+    case CTRL_KEY('f'):
+        editor_find(false);
+        break;
+
+    case CTRL_KEY('e'):
+        editor_find(true);
+        break;
+
+    case CTRL_KEY('r'):
+        editor_replace();
+        break;
+
+    case CTRL_KEY('z'):
+        editor_undo();
+        break;
+
+    case CTRL_KEY('y'):
+        editor_redo();
+        break;
+
+    // Kill ring: mark a block of lines, cut, copy, paste, older entry
+    case CTRL_KEY('b'):
+        editor_toggle_mark();
+        break;
+    case CTRL_KEY('k'):
+        editor_kill(true);
+        break;
+    case CTRL_KEY('c'):
+        editor_kill(false);
+        break;
+    case CTRL_KEY('v'):
+        editor_yank(0);
+        break;
+    case CTRL_KEY('p'):
+        editor_yank_pop();
+        break;
+    case PASTE_KEY:
+        editor_insert_text(E.paste.b, E.paste.len);
         break;
 
     case HOME_KEY:
@@ -1039,7 +6962,7 @@ void editor_process_keypress()
         break;
     case END_KEY:
         if (E.cy < E.numrows)
-            E.cx = E.row[E.cy].size;
+            E.cx = editor_row(E.cy)->size;
         break;
 
     case BACKSPACE:
@@ -1077,17 +7000,85 @@ void editor_process_keypress()
         editor_move_cursor(c);
         break;
 
-    // Ignore
-    // CTRL-L used to be used for terminal refreshing
+    // Show or hide the timing HUD
+    case CTRL_KEY('t'):
+        E.prof.hud = !E.prof.hud;
+        break;
+
+    // Redraw the whole screen, reporting what the last frame cost
     case CTRL_KEY('l'):
+        editor_set_status_message("Screen redrawn, last frame wrote %d bytes", E.frame_bytes);
+        editor_invalidate_screen();
+        break;
+
+    // Ignore
     case '\x1b':
         break;
 
+    // Nothing typed, get on with background work
+    case REFRESH_KEY:
+        editor_idle();
+        break;
+
     default:
         // Insert every other keypress
         editor_insert_char(c);
         break;
     }
+    if (c != REFRESH_KEY)
+    {
+        E.kill.prev_key = c;
+        // Anything but a paste ends the run CTRL+P can swap entries in
+        if (c != CTRL_KEY('v') && c != CTRL_KEY('p'))
+            E.kill.yanked = false;
+    }
+    editor_prof_end(PROF_KEY, span);
+}
+
+/**
+ * Handle keys as if they had been typed, for a headless editor. Like the
+ * main loop, a frame is drawn whenever the keys read so far are handled
+ */
+void editor_headless_run(const char *keys, size_t len)
+{
+    E.script = keys;
+    E.scriptlen = len;
+    while (E.scriptlen || editor_input_pending())
+    {
+        editor_process_keypress();
+        if (!editor_input_pending())
+            editor_refresh_screen();
+    }
+}
+
+/**
+ * Replay a file of recorded keys on a virtual screen and print the
+ * screen it leaves behind
+ */
+void editor_headless_replay(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+        die(path);
+    char *keys = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (keys == MAP_FAILED)
+        die("mmap");
+    close(fd);
+
+    editor_refresh_screen();
+    editor_headless_run(keys, st.st_size);
+    editor_finish_save(true);
+
+    int y;
+    for (y = 0; y < E.screen_lines; y++)
+    {
+        fwrite(E.screen[y].text, 1, E.screen[y].len, stdout);
+        fputc('\n', stdout);
+    }
+    fprintf(stderr, "%lld keys, %d bytes of frames\n", (long long)st.st_size, E.capture.len);
+    // Edits weren't saved on purpose, there is nothing to recover
+    editor_journal_close(true);
 }
 
 /**
@@ -1101,15 +7092,68 @@ void init_editor()
     E.rowoff = 0;
     E.numrows = 0;
     E.coloff = 0;
-    E.row = NULL;
+    E.rows = rows_node_new(0);
+    E.rows_hint = NULL;
+    E.rows_hint_base = 0;
     E.dirty = 0;
     E.filename = NULL;
+    E.readonly = false;
+    E.map = NULL;
+    E.maplen = 0;
+    E.view_index = NULL;
+    E.view_last = -1;
+    memset(E.view_rows, 0, sizeof(E.view_rows));
+    memset(E.view_line, -1, sizeof(E.view_line));
+    // Chain every render cache entry into the LRU list
+    int j;
+    for (j = 0; j < MIM_RENDER_CACHE; j++)
+    {
+        E.render_cache[j].gen = 0;
+        E.render_cache[j].render = NULL;
+        E.render_cache[j].rsize = 0;
+        E.render_cache[j].cap = 0;
+        E.render_cache[j].prev = j - 1;
+        E.render_cache[j].next = j + 1 < MIM_RENDER_CACHE ? j + 1 : -1;
+    }
+    E.render_head = 0;
+    E.render_tail = MIM_RENDER_CACHE - 1;
+    E.render_gen = 0;
+    editor_tab_init();
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
-    if (get_window_size(&E.screenrows, &E.screencols) == -1)
+    // A headless editor keeps the virtual screen size it was given
+    if (!E.headless && get_window_size(&E.screenrows, &E.screencols) == -1)
         die("get_window_size");
     // Reserve two space for status bar
     E.screenrows -= 2;
+    E.screen = NULL;
+    E.screen_lines = 0;
+    E.frame_bytes = 0;
+    E.frame = (struct abuf)ABUT_INIT;
+    E.line = (struct abuf)ABUT_INIT;
+    E.inpos = 0;
+    E.inlen = 0;
+    E.paste = (struct abuf)ABUT_INIT;
+    E.script = NULL;
+    E.scriptlen = 0;
+    E.capture = (struct abuf)ABUT_INIT;
+    E.resized = 0;
+    editor_init_events();
+    E.save = NULL;
+    E.save_garbage = NULL;
+    E.save_ngarbage = 0;
+    E.save_garbagecap = 0;
+    memset(&E.undo, 0, sizeof(E.undo));
+    E.undo.seal = true;
+    E.undo.limit = MIM_UNDO_LIMIT;
+    memset(&E.kill, 0, sizeof(E.kill));
+    E.kill.mark = -1;
+    memset(&E.journal, 0, sizeof(E.journal));
+    E.journal.fd = -1;
+    pthread_mutex_init(&E.journal.lock, NULL);
+    pthread_cond_init(&E.journal.cond, NULL);
+    memset(&E.prof, 0, sizeof(E.prof));
+    editor_resize_screen();
 }
 
 /**
@@ -1117,18 +7161,115 @@ void init_editor()
  */
 int main(int argc, char *argv[])
 {
-    enable_raw_mode();
+    char *filename = NULL;
+    char *script = NULL;
+    char *trace = NULL;
+    bool readonly = false;
+    bool recover = false;
+    bool piped = false;
+    int undo_mb = -1;
+    int cols = 80, rows = 24;
+    int j;
+    for (j = 1; j < argc; j++)
+    {
+        // -R opens the file as a read-only view
+        if (strcmp(argv[j], "-R") == 0)
+            readonly = true;
+        // -r replays the recovery journal left by a crashed session
+        else if (strcmp(argv[j], "-r") == 0)
+            recover = true;
+        // -u sets the undo memory limit in MB
+        else if (strcmp(argv[j], "-u") == 0 && j + 1 < argc)
+            undo_mb = atoi(argv[++j]);
+        // -k replays recorded keys without a terminal
+        else if (strcmp(argv[j], "-k") == 0 && j + 1 < argc)
+            script = argv[++j];
+        // -t writes frame timings to a trace file
+        else if (strcmp(argv[j], "-t") == 0 && j + 1 < argc)
+            trace = argv[++j];
+        // -g sets the virtual screen size for -k, as COLSxROWS
+        else if (strcmp(argv[j], "-g") == 0 && j + 1 < argc)
+            sscanf(argv[++j], "%dx%d", &cols, &rows);
+        // - reads the text from stdin
+        else if (strcmp(argv[j], "-") == 0)
+            piped = true;
+        else
+            filename = argv[j];
+    }
+    // So does running at the end of a pipe, unless keys come from a script.
+    // A terminal on stdin is the keyboard, not text
+    if (filename == NULL && !script && !isatty(STDIN_FILENO))
+        piped = true;
+    if (isatty(STDIN_FILENO))
+        piped = false;
+
+    // Take the text off stdin and put the terminal there instead, which
+    // is where everything else reads keys from
+    int input = -1;
+    if (piped)
+    {
+        input = dup(STDIN_FILENO);
+        if (input == -1)
+            die("dup");
+        fcntl(input, F_SETFD, FD_CLOEXEC);
+        if (!script)
+        {
+            int tty = open("/dev/tty", O_RDWR);
+            if (tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+                die("/dev/tty");
+            close(tty);
+        }
+    }
+
+    if (script)
+    {
+        E.headless = true;
+        E.screencols = cols > 1 ? cols : 1;
+        E.screenrows = rows > 3 ? rows : 3;
+    }
+    else
+    {
+        enable_raw_mode();
+    }
     init_editor();
-    if (argc >= 2)
+    E.readonly = readonly;
+    if (undo_mb >= 0)
+        E.undo.limit = (size_t)undo_mb << 20;
+    if (input != -1)
+    {
+        // A file name given along with - is only where the text is saved
+        if (filename)
+            E.filename = xstrdup(filename);
+        // The journal replays edits on top of the file, stdin can't be read again
+        E.journal.disabled = true;
+        editor_open_fd(input);
+    }
+    else if (filename)
     {
-        editor_open(argv[1]);
+        editor_open(filename);
     }
+    // Scripts and journal replays run on the whole file, everything
+    // else draws while it is still coming in
+    if (script || recover)
+        editor_load_step(true);
+
+    editor_set_status_message("HELP: CTRL+S to save | CTRL+Q to quit | CTRL+F to find | CTRL+G to go to line");
+    editor_journal_check(recover);
+    if (trace)
+        editor_prof_open(trace);
 
-    editor_set_status_message("HELP: CTRL+S to save | CTRL+Q to quit");
+    if (script)
+    {
+        editor_headless_replay(script);
+        return 0;
+    }
 
     while (true)
     {
-        editor_refresh_screen();
+        // Keys already read are handled before drawing, so a burst of
+        // input costs a single repaint
+        if (!editor_input_pending())
+            editor_refresh_screen();
         editor_process_keypress();
     }
     return 0;
@@ -0,0 +1,117 @@
+/*
+ * Row tree test
+ *
+ * Runs the editor headless on files of a few sizes, cutting every line,
+ * pasting it back, undoing and redoing, and saving and typing while the
+ * save shares the tree. After every step the tree is checked: row counts,
+ * no leaf without rows but an empty root, and the leaf chain in order.
+ */
+
+// Pull in the editor itself, keeping its main out of the way
+#define main mim_main
+#include "../mim.c"
+#undef main
+
+int failures;
+
+/**
+ * Collect the leaves below node in order, checking the counts on the way
+ */
+int collect(rows_node *node, rows_node **leaves, int *n)
+{
+    if (node->height == 0)
+    {
+        leaves[(*n)++] = node;
+        return node->n;
+    }
+    int total = 0;
+    int j;
+    for (j = 0; j < node->n; j++)
+    {
+        int count = collect(node->u.in.child[j], leaves, n);
+        if (count != node->u.in.count[j])
+        {
+            printf("count %d below a child, %d recorded\n", count, node->u.in.count[j]);
+            failures++;
+        }
+        total += count;
+    }
+    return total;
+}
+
+/**
+ * Check the row tree after step
+ */
+void check(const char *step, int lines)
+{
+    static rows_node *leaves[1 << 16];
+    int n = 0;
+    int total = collect(E.rows, leaves, &n);
+    int bad = failures;
+    if (total != E.numrows)
+        printf("%d lines, %s: %d rows in the tree, numrows %d\n", lines, step, total, E.numrows), failures++;
+    int j;
+    for (j = 0; j < n; j++)
+    {
+        if (leaves[j]->n == 0 && E.rows->height)
+            printf("%d lines, %s: leaf %d has no rows\n", lines, step, j), failures++;
+        if (leaves[j]->prev != (j > 0 ? leaves[j - 1] : NULL))
+            printf("%d lines, %s: leaf %d has the wrong prev\n", lines, step, j), failures++;
+        if (leaves[j]->next != (j < n - 1 ? leaves[j + 1] : NULL))
+            printf("%d lines, %s: leaf %d has the wrong next\n", lines, step, j), failures++;
+    }
+    if (failures == bad)
+        printf("%d lines, %s: ok\n", lines, step);
+}
+
+/**
+ * Replay keys, then check the tree
+ */
+void step(const char *name, const char *keys, int lines)
+{
+    editor_headless_run(keys, strlen(keys));
+    check(name, lines);
+}
+
+int main()
+{
+    int sizes[] = {40, 100, 5000};
+    int i;
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        int lines = sizes[i];
+        char path[] = "/tmp/mim-test-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd == -1)
+            die("mkstemp");
+        FILE *fp = fdopen(fd, "w");
+        int j;
+        for (j = 0; j < lines; j++)
+            fprintf(fp, "line%d\n", j);
+        fclose(fp);
+
+        E.headless = true;
+        E.screencols = 80;
+        E.screenrows = 24;
+        init_editor();
+        E.journal.disabled = true;
+        editor_open(path);
+        editor_load_step(true);
+        check("open", lines);
+
+        char keys[32];
+        snprintf(keys, sizeof(keys), "\x02\x07%d\r\x0b", lines);
+        step("cut all", keys, lines);
+        step("paste", "\x16", lines);
+        step("undo", "\x1a", lines);
+        step("redo", "\x19", lines);
+        step("undo", "\x1a", lines);
+        step("save and type", "\x13x", lines);
+        editor_finish_save(true);
+        check("saved", lines);
+
+        editor_free_rows();
+        unlink(path);
+    }
+    return failures != 0;
+}